@@ -3,6 +3,7 @@
 #include <algorithm>
 #include "sensors.h"
 #include "events.h"
+#include "event_trace.h"
 
 
 #define PIN_NUM_SDI 26
@@ -68,7 +69,9 @@ void bme280Sensor::sensors_timer()
     return;
   _read_delay_until = std::max(3u, _req_delay / 1000);
 
+  traceEvent(TRACE_SENSOR_READ_BEGIN);
   _res = bme280_get_sensor_data(BME280_ALL, &comp_data, &dev);
+  traceEvent(TRACE_SENSOR_READ_END);
   if (_res <0){
     ESP_LOGE(TAG, "_get_sensor_data status %d", _res);
     return;
@@ -4,6 +4,7 @@
 #include "bme680Sensor.h"
 #include "sensors.h"
 #include "events.h"
+#include "event_trace.h"
 
 
 #define I2C_MASTER_NUM 0
@@ -104,6 +105,8 @@ void bme680Sensor::init()
 void bme680Sensor::sensors_timer()
 {
   if (sensor_init_ok) {
+    traceEvent(TRACE_SENSOR_READ_BEGIN);
     bsec2.run();
+    traceEvent(TRACE_SENSOR_READ_END);
   }
 }
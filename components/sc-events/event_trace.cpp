@@ -0,0 +1,38 @@
+
+#include "event_trace.h"
+#include <algorithm>
+#include <string.h>
+
+#if CONFIG_EVENTS_TRACE
+
+static_assert((CONFIG_EVENTS_TRACE_RECORDS & (CONFIG_EVENTS_TRACE_RECORDS - 1))
+        == 0,
+    "the trace ring size must be a power of two");
+
+TraceRecord trace_ring[CONFIG_EVENTS_TRACE_RECORDS];
+std::atomic<uint32_t> trace_next { 0 };
+volatile bool trace_paused = false;
+
+void tracePause(bool paused) { trace_paused = paused; }
+
+size_t traceCount()
+{
+  return std::min<size_t>(trace_next.load(), CONFIG_EVENTS_TRACE_RECORDS);
+}
+
+size_t traceCopy(size_t from, TraceRecord* out, size_t count)
+{
+  uint32_t next = trace_next.load();
+  size_t available = traceCount();
+  if (from >= available) {
+    return 0;
+  }
+  count = std::min(count, available - from);
+  uint32_t oldest = next - available;
+  for (size_t i = 0; i < count; i++) {
+    out[i] = trace_ring[(oldest + from + i) % CONFIG_EVENTS_TRACE_RECORDS];
+  }
+  return count;
+}
+
+#endif
@@ -1,165 +1,544 @@
 
 #include "events.h"
+#include "event_ring.h"
+#include "event_trace.h"
+#if CONFIG_EVENTS_INSTRUMENTATION
+#include "event_histogram.h"
+#endif
 #include <algorithm>
+#include <atomic>
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
-#include <freertos/queue.h>
 #include <freertos/semphr.h>
-#include <list>
-#include <math.h>
+#include <freertos/task.h>
 #include <string.h>
 #include <string>
 
 const char* TAG = "EVENTS";
 
 Events events;
-static QueueHandle_t event_queue;
 
-Events::Events()
+// queued events carry their post time so each lane can tell how long they
+// waited before being noticed; the clock wraps every ~71 minutes, which
+// unsigned differences tolerate
+struct QueuedEvent {
+  Event event;
+  uint32_t posted_us;
+};
+
+static uint32_t nowUs() { return (uint32_t)esp_timer_get_time(); }
+
+#if CONFIG_EVENTS_OVERFLOW_BLOCK
+// esp_timer callbacks all run in this task; they must never be blocked
+static bool inTimerTask()
 {
-  event_queue = xQueueCreate(10, sizeof(Event));
-  if (event_queue == nullptr) {
-    ESP_LOGE(TAG, "Failed to create the queue");
+  static TaskHandle_t timer_task = nullptr;
+  if (timer_task == nullptr) {
+    timer_task = xTaskGetHandle("esp_timer");
   }
+  return xTaskGetCurrentTaskHandle() == timer_task;
 }
+#endif
 
-Events::~Events() { vQueueDelete(event_queue); }
+template <size_t N> struct LaneQueue {
+  EventRing<QueuedEvent, N> queue;
+  std::atomic<uint32_t> dropped { 0 };
+  // only eventsTask updates these
+  std::atomic<uint32_t> noticed { 0 };
+  std::atomic<uint32_t> max_latency_us { 0 };
+  std::atomic<uint32_t> total_latency_us { 0 };
+#if CONFIG_EVENTS_INSTRUMENTATION
+  Log2Histogram<> queue_wait;
+#endif
 
-template <typename T> struct ReduceEventsFrequency {
-  T last_x;
-  uint8_t count = 0;
-  T round_factor = 1.0;
-  ReduceEventsFrequency(T roundFactor = 0.1, T zero = 0)
-      : last_x(zero)
+  bool post(const QueuedEvent& qe)
   {
-    round_factor = 1 / round_factor;
+    bool pushed = queue.push(qe);
+#if CONFIG_EVENTS_OVERFLOW_DROP_OLDEST
+    while (!pushed) {
+      QueuedEvent oldest;
+      if (queue.pop(oldest)) {
+        dropped++;
+        ESP_LOGD(
+            TAG, "Queue full, dropped oldest %d event", oldest.event.event);
+      }
+      pushed = queue.push(qe);
+    }
+#elif CONFIG_EVENTS_OVERFLOW_BLOCK
+    if (!pushed && !inTimerTask()) {
+      for (TickType_t t = 0; !pushed && t < CONFIG_EVENTS_BLOCK_TICKS; t++) {
+        vTaskDelay(1);
+        pushed = queue.push(qe);
+      }
+    }
+#endif
+    if (!pushed) {
+      dropped++;
+    }
+    return pushed;
   }
-  bool skipEvent(T x)
+
+  void recordLatency(uint32_t posted_us)
   {
-    if (round(round_factor * last_x) / round_factor
-            != round(round_factor * x) / round_factor
-        || count++ > 6) {
-      count = 0;
-      last_x = x;
-      return false;
+    uint32_t latency = nowUs() - posted_us;
+    noticed.store(noticed.load(std::memory_order_relaxed) + 1,
+        std::memory_order_relaxed);
+    total_latency_us.store(
+        total_latency_us.load(std::memory_order_relaxed) + latency,
+        std::memory_order_relaxed);
+    if (latency > max_latency_us.load(std::memory_order_relaxed)) {
+      max_latency_us.store(latency, std::memory_order_relaxed);
     }
-    return true;
+#if CONFIG_EVENTS_INSTRUMENTATION
+    queue_wait.record(latency);
+#endif
+  }
+
+  EventsLaneStats stats() const
+  {
+    return EventsLaneStats { .noticed = noticed.load(),
+      .dropped = dropped.load(),
+      .high_water = (uint32_t)queue.highWater(),
+      .max_latency_us = max_latency_us.load(),
+      .total_latency_us = total_latency_us.load() };
   }
 };
 
-// #pragma GCC diagnostic ignored "-Wmissing-field-initializers"
+static LaneQueue<CONFIG_EVENTS_INTERACTIVE_QUEUE_LENGTH> interactive_lane;
+static LaneQueue<CONFIG_EVENTS_QUEUE_LENGTH> telemetry_lane;
+// given by the producers after each push, eventsTask sleeps on it
+static SemaphoreHandle_t event_ready;
+static std::atomic<uint32_t> events_posted { 0 };
+static std::atomic<uint32_t> events_coalesced { 0 };
+static std::atomic<uint32_t> events_batches { 0 };
+static SemaphoreHandle_t observersLock;
+
+#if CONFIG_EVENTS_COALESCE_SENSORS
+// Sensor readings only matter as their latest value, so rather than queuing
+// each of them, every sensor event type owns a slot holding the bits of its
+// newest float and a dirty bit in sensor_dirty. A new reading overwrites the
+// slot; eventsTask takes all dirty bits at once and notices each channel
+// once, with whatever value is in the slot by then.
+static std::atomic<uint32_t> sensor_slots[EVENT_MAX];
+// when the slot became dirty; written by the posting task, read by
+// eventsTask
+static std::atomic<uint32_t> sensor_posted_us[EVENT_MAX];
+static std::atomic<EventMask> sensor_dirty { 0 };
+#endif
+
+Events::Events()
+{
+  event_ready = xSemaphoreCreateBinary();
+  if (event_ready == nullptr) {
+    ESP_LOGE(TAG, "Failed to create the queue semaphore");
+  }
+  observersLock = xSemaphoreCreateMutex();
+  if (observersLock == nullptr) {
+    ESP_LOGE(TAG, "Failed to create the observers lock");
+  }
+}
+
+Events::~Events()
+{
+  vSemaphoreDelete(event_ready);
+  vSemaphoreDelete(observersLock);
+}
+
 void Events::postTouchedEvent(TouchGesture g, lv_point_t p)
 {
-  Event ev;
-  ev.event = EVENT_SCREEN_TOUCHED;
-  ev.touch_info.gesture = g;
-  ev.touch_info.p = p;
-  postEvent(ev);
+  postEvent(
+      Event { .event = EVENT_SCREEN_TOUCHED, .gesture = g, .point = p });
 }
 
 void Events::postHeartbeatEvent() { postEvent({ .event = EVENT_HEARTBEAT }); }
-void Events::postAirTemperatureEvent(float x)
+
+void Events::postOtaStarted()
+{
+  postEvent(Event { .event = EVENT_OTA_STARTED });
+}
+void Events::postOtaDoneOk()
+{
+  postEvent(Event { .event = EVENT_OTA_DONE_OK });
+}
+void Events::postOtaDoneFail()
+{
+  postEvent(Event { .event = EVENT_OTA_DONE_FAIL });
+}
+
+#if CONFIG_EVENTS_COALESCE_SENSORS
+static void postSensorValue(const Event& theEvent)
 {
-  static ReduceEventsFrequency<float> r;
-  if (!r.skipEvent(x)) {
-    postEvent(
-        Event { .event = EVENT_SENSOR_TEMPERATURE, .air_temperature = x });
+  uint32_t bits;
+  memcpy(&bits, &theEvent.value, sizeof(bits));
+  sensor_slots[theEvent.event].store(bits, std::memory_order_relaxed);
+  auto mask = eventMask(theEvent.event);
+  events_posted++;
+  if (sensor_dirty.load(std::memory_order_relaxed) & mask) {
+    events_coalesced++; // the previous value was not noticed yet
+  } else {
+    sensor_posted_us[theEvent.event].store(
+        nowUs(), std::memory_order_relaxed);
+  }
+  if (!(sensor_dirty.fetch_or(mask, std::memory_order_release) & mask)) {
+    xSemaphoreGive(event_ready);
   }
 }
-void Events::postAirHumidityEvent(float x)
+
+static Event takeSensorValue(WallControllerEvent e)
 {
-  static ReduceEventsFrequency<float> r;
-  if (!r.skipEvent(x)) {
-    postEvent(Event { .event = EVENT_SENSOR_HUMIDITY, .air_humidity = x });
+  Event event { .event = e };
+  uint32_t bits = sensor_slots[e].load(std::memory_order_relaxed);
+  memcpy(&event.value, &bits, sizeof(bits));
+  return event;
+}
+#endif
+
+void Events::postEvent(const Event& theEvent)
+{
+  traceEvent(TRACE_POST, theEvent.event);
+#if CONFIG_EVENTS_COALESCE_SENSORS
+  if (eventMask(theEvent.event) & EVENT_MASK_COALESCED) {
+    postSensorValue(theEvent);
+    return;
   }
+#endif
+  QueuedEvent qe { .event = theEvent, .posted_us = nowUs() };
+  bool pushed = (eventMask(theEvent.event) & EVENT_MASK_INTERACTIVE)
+      ? interactive_lane.post(qe)
+      : telemetry_lane.post(qe);
+  if (!pushed) {
+    ESP_LOGE(TAG, "Failed to post %d event", theEvent.event);
+    return;
+  }
+  events_posted++;
+  xSemaphoreGive(event_ready);
 }
-void Events::postIAQEvent(float x)
+
+EventsStats Events::stats() const
+{
+  return EventsStats { .posted = events_posted.load(),
+    .coalesced = events_coalesced.load(),
+    .batches = events_batches.load(),
+    .lanes = { interactive_lane.stats(), telemetry_lane.stats() } };
+}
+
+// Observers are registered rarely but noticed on every event, so eventsTask
+// reads an immutable per-event-type table without taking any lock. Writers
+// serialize on observersLock, rebuild the spare table from the registrations
+// and publish it with a pointer swap (RCU style). eventsTask is the only
+// reader and announces the table it is walking in tableInUse; a writer waits
+// for it to leave the old table before that one may be reused.
+struct ObserverSlot {
+  EventObserver* observer;
+  uint8_t id; // index into observerInfos
+};
+
+struct ObserverRegistration {
+  ObserverSlot slot;
+  EventMask mask;
+};
+
+struct ObserverTable {
+  uint32_t generation; // bumped on every publish, tables being reused
+  uint8_t count[EVENT_MAX];
+  ObserverSlot observers[EVENT_MAX][CONFIG_EVENTS_MAX_OBSERVERS];
+  // the same per observer, for batches
+  uint8_t registered;
+  ObserverRegistration registrations[CONFIG_EVENTS_MAX_OBSERVERS];
+};
+
+// Per-observer data outliving registrations: an id is assigned to an
+// observer the first time it registers and is kept, so the MQTT observer
+// keeps its id, and its notice() durations, across WiFi drops.
+struct ObserverInfo {
+  EventObserver* observer;
+#if CONFIG_EVENTS_INSTRUMENTATION
+  Log2Histogram<> handling;
+#endif
+};
+static ObserverInfo observerInfos[CONFIG_EVENTS_MAX_OBSERVERS];
+
+// caller holds observersLock
+static bool assignObserverId(ObserverSlot& slot)
 {
-  static ReduceEventsFrequency<float> r;
-  if (!r.skipEvent(x)) {
-    postEvent(Event { .event = EVENT_SENSOR_IAQ, .air_iaq = x });
+  for (uint8_t i = 0; i < CONFIG_EVENTS_MAX_OBSERVERS; i++) {
+    auto& info = observerInfos[i];
+    if (info.observer == slot.observer || info.observer == nullptr) {
+      info.observer = slot.observer;
+      slot.id = i;
+      return true;
+    }
   }
+  return false;
 }
-void Events::postAirCO2Event(float x)
+
+static ObserverRegistration registrations[CONFIG_EVENTS_MAX_OBSERVERS];
+static size_t registrationsCount = 0;
+static ObserverTable observerTables[2];
+static std::atomic<ObserverTable*> currentTable { &observerTables[0] };
+static std::atomic<ObserverTable*> tableInUse { nullptr };
+
+// caller holds observersLock
+static void publishObserverTable()
 {
-  static ReduceEventsFrequency<float> r;
-  if (!r.skipEvent(x)) {
-    postEvent(Event { .event = EVENT_SENSOR_CO2, .air_co2 = x });
+  ObserverTable* old = currentTable.load();
+  ObserverTable* spare
+      = (old == &observerTables[0]) ? &observerTables[1] : &observerTables[0];
+  memset(spare->count, 0, sizeof(spare->count));
+  spare->generation = old->generation + 1;
+  spare->registered = registrationsCount;
+  std::copy(registrations, registrations + registrationsCount,
+      spare->registrations);
+  for (size_t i = 0; i < registrationsCount; i++) {
+    const auto& r = registrations[i];
+    for (int e = 0; e < EVENT_MAX; e++) {
+      if (r.mask & eventMask((WallControllerEvent)e)) {
+        spare->observers[e][spare->count[e]++] = r.slot;
+      }
+    }
+  }
+  currentTable.store(spare);
+  while (tableInUse.load() == old) {
+    vTaskDelay(1);
   }
 }
-void Events::postAirVOCEvent(float x)
+
+void Events::registerObserver(EventObserver* observer, EventMask mask)
 {
-  static ReduceEventsFrequency<float> r;
-  if (!r.skipEvent(x)) {
-    postEvent(Event { .event = EVENT_SENSOR_VOC, .air_voc = x });
+  assert(observer != nullptr);
+  xSemaphoreTake(observersLock, portMAX_DELAY);
+  auto end = registrations + registrationsCount;
+  auto pos = std::find_if(registrations, end,
+      [=](const ObserverRegistration& r) {
+        return r.slot.observer == observer;
+      });
+  if (pos != end) {
+    pos->mask = mask;
+  } else if (registrationsCount < CONFIG_EVENTS_MAX_OBSERVERS) {
+    ObserverRegistration& r = registrations[registrationsCount];
+    r.slot.observer = observer;
+    r.mask = mask;
+    if (!assignObserverId(r.slot)) {
+      ESP_LOGE(TAG, "No observer id left for %s", observer->name());
+      xSemaphoreGive(observersLock);
+      return;
+    }
+    registrationsCount++;
+  } else {
+    ESP_LOGE(TAG, "Too many observers, cannot register %s", observer->name());
+    xSemaphoreGive(observersLock);
+    return;
   }
+  publishObserverTable();
+  xSemaphoreGive(observersLock);
 }
-void Events::postAirPressureEvent(float x)
+
+void Events::unregisterObserver(EventObserver* observer)
 {
-  static ReduceEventsFrequency<float> r;
-  if (!r.skipEvent(x)) {
-    postEvent(Event { .event = EVENT_SENSOR_PRESSURE, .air_pressure = x });
+  xSemaphoreTake(observersLock, portMAX_DELAY);
+  auto end = registrations + registrationsCount;
+  auto pos = std::remove_if(registrations, end,
+      [=](const ObserverRegistration& r) {
+        return r.slot.observer == observer;
+      });
+  if (pos != end) {
+    registrationsCount = pos - registrations;
+    publishObserverTable();
   }
+  xSemaphoreGive(observersLock);
 }
 
-#if CONFIG_HAS_EXTERNAL_SENSOR == 1
-void Events::postExtTemperatureEvent(float x)
+const char* Events::observerName(uint8_t id) const
 {
-  static ReduceEventsFrequency<float> r;
-  if (!r.skipEvent(x)) {
-    postEvent(Event {
-        .event = EVENT_SENSOR_EXT_TEMPERATURE, .air_temperature = x });
+  if (id >= CONFIG_EVENTS_MAX_OBSERVERS || !observerInfos[id].observer) {
+    return nullptr;
   }
+  return observerInfos[id].observer->name();
 }
 
-void Events::postExtHumidityEvent(float x)
+static const ObserverTable* acquireObserverTable()
 {
-  static ReduceEventsFrequency<float> r;
-  if (!r.skipEvent(x)) {
-    postEvent(
-        Event { .event = EVENT_SENSOR_EXT_HUMIDITY, .air_humidity = x });
+  ObserverTable* table = currentTable.load();
+  tableInUse.store(table);
+  // a writer may have swapped the table before it saw our announcement
+  for (ObserverTable* again; (again = currentTable.load()) != table;) {
+    table = again;
+    tableInUse.store(table);
   }
+  return table;
 }
-#endif
 
-void Events::postOtaStarted()
+static void releaseObserverTable() { tableInUse.store(nullptr); }
+
+#if CONFIG_EVENTS_INSTRUMENTATION
+size_t Events::formatHistograms(char* buf, size_t len) const
 {
-  postEvent(Event { .event = EVENT_OTA_STARTED });
+  static const char* LANE_NAMES[EVENT_LANE_MAX]
+      = { "interactive", "telemetry" };
+  const Log2Histogram<>* lanes[EVENT_LANE_MAX]
+      = { &interactive_lane.queue_wait, &telemetry_lane.queue_wait };
+  size_t used = 0;
+  auto append = [&](const char* kind, const char* name,
+                    const Log2Histogram<>& h) {
+    if (used < len) {
+      used += snprintf(buf + used, len - used, "%s %s: ", kind, name);
+    }
+    if (used < len) {
+      used += h.format(buf + used, len - used);
+    }
+    if (used < len) {
+      used += snprintf(buf + used, len - used, "\n");
+    }
+  };
+  for (int l = 0; l < EVENT_LANE_MAX; l++) {
+    append("wait", LANE_NAMES[l], *lanes[l]);
+  }
+  for (const auto& info : observerInfos) {
+    if (info.observer != nullptr) {
+      append("notice", info.observer->name(), info.handling);
+    }
+  }
+  return used < len ? used : len;
 }
-void Events::postOtaDoneOk()
+#endif
+
+static void logStats()
 {
-  postEvent(Event { .event = EVENT_OTA_DONE_OK });
+  auto st = events.stats();
+  ESP_LOGI(TAG, "posted: %u, coalesced: %u, batches: %u", st.posted,
+      st.coalesced, st.batches);
+  for (int l = 0; l < EVENT_LANE_MAX; l++) {
+    const auto& ls = st.lanes[l];
+    ESP_LOGI(TAG,
+        "lane %d: noticed: %u, dropped: %u, high water: %u, latency avg: "
+        "%u us, max: %u us",
+        l, ls.noticed, ls.dropped, ls.high_water,
+        ls.noticed ? ls.total_latency_us / ls.noticed : 0,
+        ls.max_latency_us);
+  }
+#if 0
+  ESP_LOGI(TAG, "heap: %d, min free: %d",
+      heap_caps_get_free_size(MALLOC_CAP_DEFAULT),
+      heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT));
+#endif
 }
-void Events::postOtaDoneFail()
+
+static void dispatchEvent(const Event& event)
 {
-  postEvent(Event { .event = EVENT_OTA_DONE_FAIL });
+  const ObserverTable* table = acquireObserverTable();
+  const ObserverSlot* slot = table->observers[event.event];
+  for (uint8_t i = 0; i < table->count[event.event]; i++) {
+    ESP_LOGD(TAG, "Notifying %s", slot[i].observer->name());
+    traceEvent(TRACE_NOTICE_BEGIN, event.event, slot[i].id);
+#if CONFIG_EVENTS_INSTRUMENTATION
+    uint32_t start = nowUs();
+    slot[i].observer->notice(event);
+    observerInfos[slot[i].id].handling.record(nowUs() - start);
+#else
+    slot[i].observer->notice(event);
+#endif
+    traceEvent(TRACE_NOTICE_END, event.event, slot[i].id);
+  }
+  releaseObserverTable();
+  if (event.event == EVENT_HEARTBEAT) {
+    logStats();
+  }
 }
 
-void Events::postEvent(const Event& theEvent)
+static void drainInteractiveLane()
 {
-  if (pdPASS != xQueueSendToBack(event_queue, &theEvent, 10)) {
-    ESP_LOGE(TAG, "Failed to post %d event", theEvent.event);
+  QueuedEvent qe;
+  while (interactive_lane.queue.pop(qe)) {
+    traceEvent(TRACE_DEQUEUE, qe.event.event, EVENT_LANE_INTERACTIVE);
+    interactive_lane.recordLatency(qe.posted_us);
+    dispatchEvent(qe.event);
   }
 }
 
-static std::list<EventObserver*> observers;
-static SemaphoreHandle_t observersLock = NULL;
+// Everything pending on the telemetry lane and in the sensor slots, taken at
+// once; only eventsTask uses these. Producers may refill the lane while it
+// is drained, so at most a queue's worth is taken from it, leaving room for
+// one event per sensor slot; the rest waits for the next batch.
+constexpr size_t BATCH_MAX = CONFIG_EVENTS_QUEUE_LENGTH + EVENT_MAX;
+static Event batch[BATCH_MAX];
+static Event observerBatch[BATCH_MAX];
 
-void Events::registerObserver(EventObserver* observer)
+static size_t takeTelemetryBatch()
 {
-  if (NULL == observersLock) {
-    observersLock = xSemaphoreCreateMutex();
+  size_t count = 0;
+  QueuedEvent qe;
+  while (count < CONFIG_EVENTS_QUEUE_LENGTH && telemetry_lane.queue.pop(qe)) {
+    traceEvent(TRACE_DEQUEUE, qe.event.event, EVENT_LANE_TELEMETRY);
+    telemetry_lane.recordLatency(qe.posted_us);
+    batch[count++] = qe.event;
   }
-  xSemaphoreTake(observersLock, portMAX_DELAY);
-  observers.push_back(observer);
-  xSemaphoreGive(observersLock);
+#if CONFIG_EVENTS_COALESCE_SENSORS
+  EventMask dirty = sensor_dirty.exchange(0, std::memory_order_acquire);
+  while (dirty) {
+    auto e = (WallControllerEvent)__builtin_ctz(dirty);
+    dirty &= dirty - 1;
+    traceEvent(TRACE_DEQUEUE, e, EVENT_LANE_TELEMETRY);
+    telemetry_lane.recordLatency(
+        sensor_posted_us[e].load(std::memory_order_relaxed));
+    batch[count++] = takeSensorValue(e);
+  }
+#endif
+  return count;
 }
 
-void Events::unregisterObserver(EventObserver* observer)
+// Hands each observer the part of the batch it registered for, in one
+// noticeBatch() call. The interactive lane is drained between observers, so
+// a touch never waits for more than one observer's batch. The table may
+// change meanwhile; the walk then starts over on the new one, skipping the
+// observers already handed the batch.
+static_assert(CONFIG_EVENTS_MAX_OBSERVERS <= 32, "observer ids in a mask");
+static void dispatchBatch(size_t count)
 {
-  xSemaphoreTake(observersLock, portMAX_DELAY);
-  observers.remove(observer);
-  xSemaphoreGive(observersLock);
+  uint32_t delivered = 0; // observer ids
+  const ObserverTable* table = acquireObserverTable();
+  uint32_t generation = table->generation;
+  for (uint8_t r = 0; r < table->registered;) {
+    const auto& reg = table->registrations[r++];
+    if (delivered & (1u << reg.slot.id)) {
+      continue;
+    }
+    delivered |= 1u << reg.slot.id;
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+      if (reg.mask & eventMask(batch[i].event)) {
+        observerBatch[n++] = batch[i];
+      }
+    }
+    if (n == 0) {
+      continue;
+    }
+    ESP_LOGD(TAG, "Notifying %s of %u events", reg.slot.observer->name(), n);
+    traceEvent(TRACE_NOTICE_BEGIN, observerBatch[0].event, reg.slot.id);
+#if CONFIG_EVENTS_INSTRUMENTATION
+    uint32_t start = nowUs();
+    reg.slot.observer->noticeBatch(observerBatch, n);
+    observerInfos[reg.slot.id].handling.record(nowUs() - start);
+#else
+    reg.slot.observer->noticeBatch(observerBatch, n);
+#endif
+    traceEvent(TRACE_NOTICE_END, observerBatch[0].event, reg.slot.id);
+    // dispatchEvent() takes the table again, give it back first
+    releaseObserverTable();
+    drainInteractiveLane();
+    table = acquireObserverTable();
+    if (table->generation != generation) {
+      generation = table->generation;
+      r = 0;
+    }
+  }
+  releaseObserverTable();
+  events_batches++;
+  for (size_t i = 0; i < count; i++) {
+    if (batch[i].event == EVENT_HEARTBEAT) {
+      logStats();
+    }
+  }
 }
 
 void eventsTask(void*)
@@ -167,24 +546,14 @@ void eventsTask(void*)
   ESP_LOGI(TAG, "Starting events task");
 
   while (true) {
-    Event event;
-    if (pdTRUE == xQueueReceive(event_queue, &event, portMAX_DELAY)) {
-      std::for_each(
-          observers.begin(), observers.end(), [=](EventObserver* observer) {
-            if (observer != nullptr) {
-              ESP_LOGD(TAG, "Notifying %s", observer->name());
-              observer->notice(event);
-            } else {
-              assert(0);
-            }
-          });
-#if 0
-      if (event.event == EVENT_HEARTBEAT) {
-        ESP_LOGI(TAG, "heap: %d, min free: %d",
-            heap_caps_get_free_size(MALLOC_CAP_DEFAULT),
-            heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT));
+    xSemaphoreTake(event_ready, portMAX_DELAY);
+    for (bool more = true; more;) {
+      drainInteractiveLane();
+      size_t count = takeTelemetryBatch();
+      if (count > 0) {
+        dispatchBatch(count);
       }
-#endif
+      more = count > 0;
     }
   }
 
@@ -0,0 +1,44 @@
+#ifndef _EVENT_HISTOGRAM_H_INCLUDED_
+#define _EVENT_HISTOGRAM_H_INCLUDED_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Fixed-bucket histogram of microsecond durations. Bucket 0 counts zero
+// durations, bucket i counts [2^(i-1), 2^i) us and the last bucket also
+// takes everything longer. Recording is a count-leading-zeros and an
+// increment; it is meant for a single writer.
+template <size_t BUCKETS = 20> struct Log2Histogram {
+  static_assert(BUCKETS >= 2 && BUCKETS <= 33, "unsupported bucket count");
+
+  uint32_t buckets[BUCKETS] = {};
+
+  void record(uint32_t us)
+  {
+    size_t b = us ? 32 - __builtin_clz(us) : 0;
+    buckets[b < BUCKETS ? b : BUCKETS - 1]++;
+  }
+
+  // writes the bucket counts separated by spaces, trailing empty buckets
+  // omitted; returns what snprintf would, like snprintf
+  int format(char* buf, size_t len) const
+  {
+    size_t last = BUCKETS;
+    while (last > 0 && buckets[last - 1] == 0) {
+      last--;
+    }
+    int total = 0;
+    for (size_t b = 0; b < last; b++) {
+      size_t used = (size_t)total < len ? (size_t)total : len;
+      total += snprintf(buf + used, len - used, b ? " %u" : "%u",
+          (unsigned)buckets[b]);
+    }
+    if (last == 0 && len > 0) {
+      buf[0] = 0;
+    }
+    return total;
+  }
+};
+
+#endif /* ifndef _EVENT_HISTOGRAM_H_INCLUDED_ */
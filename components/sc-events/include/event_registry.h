@@ -0,0 +1,49 @@
+#ifndef _EVENT_REGISTRY_H_INCLUDED_
+#define _EVENT_REGISTRY_H_INCLUDED_
+
+// The one list of wall controller events. The WallControllerEvent enum, the
+// Events::post*Event functions for sensor readings, the event masks, the MQTT
+// topics, payload formats and rate policies are all generated from it, so a
+// new sensor is one SENSOR line here plus the driver reading it.
+//
+// EVENT(id, payload, MQTT leaf topic, retain, constant MQTT payload or
+//       nullptr)
+// SENSOR(id, post function name, MQTT leaf topic, decimals, deadband,
+//        urgent) - a float reading, retained on the broker; deadband and
+//        urgent are those of its MQTT RatePolicy
+//
+// The order is the enum order, which traces rely on: keep
+// tools/trace2chrome.py in sync.
+
+#if CONFIG_HAS_EXTERNAL_SENSOR == 1
+#define EXT_SENSOR_EVENTS(SENSOR)                                            \
+  SENSOR(EVENT_SENSOR_EXT_TEMPERATURE, ExtTemperature, "ext_temperature", 1, \
+      0.1f, 0.5f)                                                            \
+  SENSOR(EVENT_SENSOR_EXT_HUMIDITY, ExtHumidity, "ext_humidity", 1, 0.1f,    \
+      3.0f)
+#else
+#define EXT_SENSOR_EVENTS(SENSOR)
+#endif
+
+// clang-format off
+#define WALL_CONTROLLER_EVENTS(EVENT, SENSOR)                                  \
+  EVENT(EVENT_STATUS_UPDATE, EVENT_PAYLOAD_STATUS, "status", false, nullptr)   \
+  EVENT(EVENT_HEARTBEAT, EVENT_PAYLOAD_NONE, "heartbeat", true, "on")          \
+  SENSOR(EVENT_SENSOR_TEMPERATURE, AirTemperature, "air_temperature", 1,       \
+      0.1f, 0.5f)                                                              \
+  SENSOR(EVENT_SENSOR_HUMIDITY, AirHumidity, "air_humidity", 1, 0.1f, 3.0f)    \
+  EVENT(EVENT_SCREEN_TOUCHED, EVENT_PAYLOAD_TOUCH, "touched", false, nullptr)  \
+  /* BSEC_OUTPUT_RUN_IN_STATUS */                                              \
+  EVENT(EVENT_SENSOR_GAS_STATUS, EVENT_PAYLOAD_BOOL, "gas_status", true,       \
+      nullptr)                                                                 \
+  SENSOR(EVENT_SENSOR_IAQ, IAQ, "air_iaq", 2, 1.0f, 25.0f)                     \
+  SENSOR(EVENT_SENSOR_CO2, AirCO2, "air_co2", 2, 10.0f, 200.0f)                \
+  SENSOR(EVENT_SENSOR_VOC, AirVOC, "air_voc", 2, 0.1f, 1.0f)                   \
+  SENSOR(EVENT_SENSOR_PRESSURE, AirPressure, "air_pressure", 0, 1.0f, 3.0f)    \
+  EXT_SENSOR_EVENTS(SENSOR)                                                    \
+  EVENT(EVENT_OTA_STARTED, EVENT_PAYLOAD_NONE, "ota", false, "start")          \
+  EVENT(EVENT_OTA_DONE_OK, EVENT_PAYLOAD_NONE, "ota", false, "OK")             \
+  EVENT(EVENT_OTA_DONE_FAIL, EVENT_PAYLOAD_NONE, "ota", false, "FAIL")
+// clang-format on
+
+#endif /* ifndef _EVENT_REGISTRY_H_INCLUDED_ */
@@ -0,0 +1,117 @@
+#ifndef _EVENT_RING_H_INCLUDED_
+#define _EVENT_RING_H_INCLUDED_
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+// Bounded lock-free ring buffer, safe for any number of producers and
+// consumers (Vyukov's sequence-per-cell scheme). Each cell carries a sequence
+// number telling whether it is free for the producer of a given lap or ready
+// for the consumer, so push() and pop() only ever CAS their own cursor and
+// never take a lock or block. Several pop()ers are allowed on purpose: the
+// drop-oldest overflow policy lets a producer evict the head itself.
+//
+// N must be a power of two.
+template <typename T, size_t N> class EventRing {
+  static_assert(N >= 2 && (N & (N - 1)) == 0,
+      "EventRing capacity must be a power of two");
+
+  public:
+  EventRing()
+  {
+    for (size_t i = 0; i < N; i++) {
+      _cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  EventRing(const EventRing&) = delete;
+  EventRing& operator=(const EventRing&) = delete;
+
+  // returns false, leaving the ring untouched, when it is full
+  bool push(const T& item)
+  {
+    size_t pos = _tail.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell& cell = _cells[pos & MASK];
+      size_t seq = cell.seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if (diff == 0) {
+        if (_tail.compare_exchange_weak(
+                pos, pos + 1, std::memory_order_relaxed)) {
+          cell.data = item;
+          cell.seq.store(pos + 1, std::memory_order_release);
+          updateHighWater(pos + 1);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = _tail.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // returns false when the ring is empty
+  bool pop(T& item)
+  {
+    size_t pos = _head.load(std::memory_order_relaxed);
+    for (;;) {
+      Cell& cell = _cells[pos & MASK];
+      size_t seq = cell.seq.load(std::memory_order_acquire);
+      intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+      if (diff == 0) {
+        if (_head.compare_exchange_weak(
+                pos, pos + 1, std::memory_order_relaxed)) {
+          item = cell.data;
+          cell.seq.store(pos + N, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = _head.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // approximate when producers or consumers are running concurrently
+  size_t size() const
+  {
+    size_t tail = _tail.load(std::memory_order_relaxed);
+    size_t head = _head.load(std::memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+  }
+
+  static constexpr size_t capacity() { return N; }
+  size_t highWater() const
+  {
+    return _high_water.load(std::memory_order_relaxed);
+  }
+
+  private:
+  static constexpr size_t MASK = N - 1;
+
+  void updateHighWater(size_t tail)
+  {
+    size_t head = _head.load(std::memory_order_relaxed);
+    size_t depth = tail > head ? tail - head : 0;
+    size_t hw = _high_water.load(std::memory_order_relaxed);
+    while (depth > hw
+        && !_high_water.compare_exchange_weak(
+            hw, depth, std::memory_order_relaxed)) {
+    }
+  }
+
+  struct Cell {
+    std::atomic<size_t> seq;
+    T data;
+  };
+
+  Cell _cells[N];
+  std::atomic<size_t> _tail { 0 };
+  std::atomic<size_t> _head { 0 };
+  std::atomic<size_t> _high_water { 0 };
+};
+
+#endif /* ifndef _EVENT_RING_H_INCLUDED_ */
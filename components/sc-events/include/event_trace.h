@@ -0,0 +1,62 @@
+#ifndef _EVENT_TRACE_H_INCLUDED_
+#define _EVENT_TRACE_H_INCLUDED_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// What a trace record stands for. Spans come as BEGIN/END pairs of the same
+// kind; tools/trace2chrome.py knows these values, keep it in sync.
+enum TraceKind : uint8_t {
+  TRACE_POST, // id: event type
+  TRACE_DEQUEUE, // id: event type, arg: lane
+  TRACE_NOTICE_BEGIN, // id: event type, arg: observer id
+  TRACE_NOTICE_END,
+  TRACE_DISPLAY_FLUSH_BEGIN, // arg: number of lines
+  TRACE_DISPLAY_FLUSH_END,
+  TRACE_MQTT_ENQUEUE_BEGIN, // id: event type
+  TRACE_MQTT_ENQUEUE_END,
+  TRACE_SENSOR_READ_BEGIN,
+  TRACE_SENSOR_READ_END,
+};
+
+struct __attribute__((packed)) TraceRecord {
+  uint32_t ts_us; // low 32 bits of esp_timer_get_time()
+  TraceKind kind;
+  uint8_t id;
+  uint16_t arg;
+};
+static_assert(sizeof(TraceRecord) == 8, "TraceRecord must stay packed");
+
+#if CONFIG_EVENTS_TRACE
+#include <atomic>
+#include <esp_timer.h>
+
+extern TraceRecord trace_ring[CONFIG_EVENTS_TRACE_RECORDS];
+extern std::atomic<uint32_t> trace_next;
+extern volatile bool trace_paused;
+
+// Records into a fixed ring, overwriting the oldest records; an index
+// increment and an 8-byte store, no lock and no allocation. Safe from any
+// task.
+inline void traceEvent(TraceKind kind, uint8_t id = 0, uint16_t arg = 0)
+{
+  if (trace_paused) {
+    return;
+  }
+  uint32_t i = trace_next.fetch_add(1, std::memory_order_relaxed);
+  trace_ring[i % CONFIG_EVENTS_TRACE_RECORDS]
+      = TraceRecord { (uint32_t)esp_timer_get_time(), kind, id, arg };
+}
+
+// Stops recording while the ring is copied out, e.g. for an MQTT dump.
+void tracePause(bool paused);
+// Number of valid records, at most CONFIG_EVENTS_TRACE_RECORDS.
+size_t traceCount();
+// Copies up to count records starting at the from-th oldest one; returns the
+// number copied. Only meaningful while paused.
+size_t traceCopy(size_t from, TraceRecord* out, size_t count);
+#else
+inline void traceEvent(TraceKind, uint8_t = 0, uint16_t = 0) { }
+#endif
+
+#endif /* ifndef _EVENT_TRACE_H_INCLUDED_ */
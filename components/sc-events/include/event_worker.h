@@ -0,0 +1,134 @@
+#ifndef _EVENT_WORKER_H_INCLUDED_
+#define _EVENT_WORKER_H_INCLUDED_
+
+#include "event_ring.h"
+#include "events.h"
+#include <atomic>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+// what an EventWorker does when its inbox is full
+enum InboxOverflow {
+  INBOX_DROP_OLDEST, // the newest events matter most, e.g. for telemetry
+  INBOX_DROP_NEWEST,
+};
+
+struct EventWorkerStats {
+  uint32_t noticed;
+  uint32_t dropped;
+  uint32_t high_water; // deepest the inbox has been since boot
+};
+
+// Notices an observer from a task of its own. Register the worker in place
+// of the observer: eventsTask then only copies each event into the bounded
+// inbox, never blocking, so an observer that may block (e.g. on the MQTT
+// outbox lock) no longer holds up the others. Until start() succeeds the
+// observer is noticed inline, as if it were registered directly. Whatever
+// is in the inbox when the task wakes up is handed over in one
+// noticeBatch() call, oldest first.
+//
+// N must be a power of two.
+template <size_t N> class EventWorker : public EventObserver {
+  public:
+  EventWorker(EventObserver& observer, InboxOverflow overflow)
+      : _observer(observer)
+      , _overflow(overflow)
+  {
+  }
+
+  bool start(const char* task_name, uint32_t stack_size, UBaseType_t priority,
+      BaseType_t core)
+  {
+    if (_task != nullptr) {
+      return true;
+    }
+    _ready = xSemaphoreCreateBinary();
+    if (_ready == nullptr) {
+      return false;
+    }
+    return pdPASS
+        == xTaskCreatePinnedToCore(
+            &run, task_name, stack_size, this, priority, &_task, core);
+  }
+
+  virtual void notice(const Event& event) override
+  {
+    if (_task == nullptr) {
+      _observer.notice(event);
+      _noticed++;
+      return;
+    }
+    if (!push(event)) {
+      _dropped++;
+      return;
+    }
+    xSemaphoreGive(_ready);
+  }
+
+  virtual void noticeBatch(const Event* batch, size_t count) override
+  {
+    if (_task == nullptr) {
+      _observer.noticeBatch(batch, count);
+      _noticed += count;
+      return;
+    }
+    for (size_t i = 0; i < count; i++) {
+      if (!push(batch[i])) {
+        _dropped++;
+      }
+    }
+    xSemaphoreGive(_ready);
+  }
+
+  virtual const char* name() override { return _observer.name(); }
+
+  EventWorkerStats stats() const
+  {
+    return EventWorkerStats { .noticed = _noticed.load(),
+      .dropped = _dropped.load(),
+      .high_water = (uint32_t)_inbox.highWater() };
+  }
+
+  private:
+  bool push(const Event& event)
+  {
+    bool pushed = _inbox.push(event);
+    if (!pushed && _overflow == INBOX_DROP_OLDEST) {
+      Event oldest;
+      if (_inbox.pop(oldest)) {
+        _dropped++;
+      }
+      pushed = _inbox.push(event);
+    }
+    return pushed;
+  }
+
+  static void run(void* arg)
+  {
+    auto self = static_cast<EventWorker*>(arg);
+    while (true) {
+      xSemaphoreTake(self->_ready, portMAX_DELAY);
+      Event batch[N];
+      for (size_t count = N; count == N;) {
+        for (count = 0; count < N && self->_inbox.pop(batch[count]);) {
+          count++;
+        }
+        if (count > 0) {
+          self->_observer.noticeBatch(batch, count);
+          self->_noticed += count;
+        }
+      }
+    }
+  }
+
+  EventObserver& _observer;
+  const InboxOverflow _overflow;
+  EventRing<Event, N> _inbox;
+  SemaphoreHandle_t _ready = nullptr;
+  TaskHandle_t _task = nullptr;
+  std::atomic<uint32_t> _noticed { 0 };
+  std::atomic<uint32_t> _dropped { 0 };
+};
+
+#endif /* ifndef _EVENT_WORKER_H_INCLUDED_ */
@@ -1,35 +1,79 @@
 #ifndef _EVENTS_H_INCLUDED_
 #define _EVENTS_H_INCLUDED_
 
+#include "event_registry.h"
 #include <esp_event.h>
 #include <lvgl.h>
 
-enum WallControllerEvent {
-  EVENT_STATUS_UPDATE,
-  EVENT_HEARTBEAT,
-  EVENT_SENSOR_TEMPERATURE,
-  EVENT_SENSOR_HUMIDITY,
-  EVENT_SCREEN_TOUCHED,
-  EVENT_SENSOR_GAS_STATUS, // BSEC_OUTPUT_RUN_IN_STATUS
-  EVENT_SENSOR_IAQ,
-  EVENT_SENSOR_CO2,
-  EVENT_SENSOR_VOC,
-  EVENT_SENSOR_PRESSURE,
-#if CONFIG_HAS_EXTERNAL_SENSOR == 1
-  EVENT_SENSOR_EXT_TEMPERATURE,
-  EVENT_SENSOR_EXT_HUMIDITY,
-#endif
-  EVENT_OTA_STARTED,
-  EVENT_OTA_DONE_OK,
-  EVENT_OTA_DONE_FAIL
+#define EVENT_ENUM_ENTRY(id, ...) id,
+enum WallControllerEvent : uint8_t {
+  WALL_CONTROLLER_EVENTS(EVENT_ENUM_ENTRY, EVENT_ENUM_ENTRY) EVENT_MAX
+};
+#undef EVENT_ENUM_ENTRY
+
+enum EventPayload : uint8_t {
+  EVENT_PAYLOAD_NONE,
+  EVENT_PAYLOAD_STATUS,
+  EVENT_PAYLOAD_TOUCH,
+  EVENT_PAYLOAD_BOOL,
+  EVENT_PAYLOAD_FLOAT, // sensor readings
+};
+
+// what event_registry.h says about an event, see EVENT_DESCRIPTORS
+struct EventDescriptor {
+  EventPayload payload;
+  const char* topic; // MQTT leaf topic, under barlog/<host>
+  bool retain;
+  uint8_t decimals; // EVENT_PAYLOAD_FLOAT only
+  const char* constant; // fixed MQTT payload, nullptr when formatted
+  float deadband; // MQTT RatePolicy, EVENT_PAYLOAD_FLOAT only
+  float urgent;
+};
+
+#define EVENT_DESCRIPTOR(id, payload, topic, retain, constant)               \
+  { payload, topic, retain, 0, constant, 0.0f, 0.0f },
+#define SENSOR_DESCRIPTOR(id, name, topic, decimals, deadband, urgent)       \
+  { EVENT_PAYLOAD_FLOAT, topic, true, decimals, nullptr, deadband, urgent },
+inline constexpr EventDescriptor EVENT_DESCRIPTORS[] = {
+  WALL_CONTROLLER_EVENTS(EVENT_DESCRIPTOR, SENSOR_DESCRIPTOR)
 };
+#undef EVENT_DESCRIPTOR
+#undef SENSOR_DESCRIPTOR
+static_assert(sizeof(EVENT_DESCRIPTORS) / sizeof(EVENT_DESCRIPTORS[0])
+        == EVENT_MAX,
+    "one descriptor per event");
+
+// observers register with the set of event types they want to be noticed of
+typedef uint32_t EventMask;
+static_assert(EVENT_MAX <= 32, "EventMask is too narrow");
+constexpr EventMask eventMask(WallControllerEvent e) { return 1u << e; }
+constexpr EventMask payloadMask(EventPayload payload)
+{
+  EventMask mask = 0;
+  for (int e = 0; e < EVENT_MAX; e++) {
+    if (EVENT_DESCRIPTORS[e].payload == payload) {
+      mask |= eventMask((WallControllerEvent)e);
+    }
+  }
+  return mask;
+}
+constexpr EventMask EVENT_MASK_ALL = ~0u;
+// sensor readings coalesced into a latest-value slot each, see
+// EVENTS_COALESCE_SENSORS
+constexpr EventMask EVENT_MASK_COALESCED = payloadMask(EVENT_PAYLOAD_FLOAT);
+constexpr EventMask EVENT_MASK_SENSORS
+    = EVENT_MASK_COALESCED | eventMask(EVENT_SENSOR_GAS_STATUS);
+constexpr EventMask EVENT_MASK_OTA = eventMask(EVENT_OTA_STARTED)
+    | eventMask(EVENT_OTA_DONE_OK) | eventMask(EVENT_OTA_DONE_FAIL);
+constexpr EventMask EVENT_MASK_INTERACTIVE
+    = eventMask(EVENT_SCREEN_TOUCHED) | EVENT_MASK_OTA;
 
-enum WallControllerStatus {
+enum WallControllerStatus : uint8_t {
   STATUS_DHT_OK = 0x00,
   STATUS_DHT_FAIL = 0x01,
 };
 
-enum TouchGesture {
+enum TouchGesture : uint8_t {
   TOUCH_GESTURE_OFF =0, // special value meaning no gesture was actually found
   TOUCH_GESTURE_SHORT_PRESS,
   TOUCH_GESTURE_LONG_PRESS,
@@ -40,26 +84,55 @@ enum TouchGesture {
   TOUCH_GESTURE_MAX
 };
 
+// Events are copied through the lanes by value, so they are kept to 8
+// bytes: the gesture sits next to the type rather than in the union, which
+// would otherwise grow past the float to hold it along with the point.
 struct Event {
   WallControllerEvent event;
+  TouchGesture gesture; // EVENT_SCREEN_TOUCHED
   union {
     WallControllerStatus status;
-    struct {
-      TouchGesture gesture;
-      lv_point_t p;
-    } touch_info;
-    float air_temperature;
-    float air_humidity;
+    lv_point_t point; // EVENT_SCREEN_TOUCHED
     bool gas_status;
-    float air_iaq;
-    float air_co2;
-    float air_voc;      //
-    float air_pressure; // hPa
+    float value; // EVENT_PAYLOAD_FLOAT, in the sensor's unit (hPa, %, ...)
   };
 };
+static_assert(sizeof(lv_coord_t) > 2 || sizeof(Event) == 8,
+    "Event grew past 8 bytes");
+
+// interactive events are noticed before any pending telemetry
+enum EventLane {
+  EVENT_LANE_INTERACTIVE,
+  EVENT_LANE_TELEMETRY,
+  EVENT_LANE_MAX
+};
+
+struct EventsLaneStats {
+  uint32_t noticed;
+  uint32_t dropped;
+  uint32_t high_water; // deepest the lane queue has been since boot
+  uint32_t max_latency_us; // from post to the first observer being noticed
+  uint32_t total_latency_us;
+};
+
+struct EventsStats {
+  uint32_t posted;
+  uint32_t coalesced; // sensor readings overwritten before being noticed
+  uint32_t batches; // telemetry batches delivered
+  EventsLaneStats lanes[EVENT_LANE_MAX];
+};
 
 struct EventObserver {
   virtual void notice(const Event&) = 0;
+  // Telemetry is delivered in batches: whatever was pending when eventsTask
+  // woke up, restricted to the events the observer registered for, oldest
+  // first. Override to act once per batch rather than once per event.
+  virtual void noticeBatch(const Event* batch, size_t count)
+  {
+    for (size_t i = 0; i < count; i++) {
+      notice(batch[i]);
+    }
+  }
   virtual const char* name() =0;
 };
 
@@ -68,20 +141,33 @@ class Events {
   Events();
   virtual ~Events();
   void postHeartbeatEvent();
-  void postAirTemperatureEvent(float);
-  void postAirHumidityEvent(float);
-  void postIAQEvent(float);
-  void postAirCO2Event(float);
-  void postAirVOCEvent(float);
-  void postAirPressureEvent(float);
+  // postAirTemperatureEvent(float) and the like, one per SENSOR
+#define EVENT_POST(...)
+#define SENSOR_POST(id, name, ...)                                           \
+  void post##name##Event(float x)                                            \
+  {                                                                          \
+    postEvent(Event { .event = id, .value = x });                            \
+  }
+  WALL_CONTROLLER_EVENTS(EVENT_POST, SENSOR_POST)
+#undef EVENT_POST
+#undef SENSOR_POST
   void postTouchedEvent(TouchGesture, lv_point_t);
-  void postExtTemperatureEvent(float);
-  void postExtHumidityEvent(float);
   void postOtaStarted();
   void postOtaDoneOk();
   void postOtaDoneFail();
-  void registerObserver(EventObserver*);
+  // registering an already registered observer only updates its mask;
+  // neither call may be made from within an observer's notice()
+  void registerObserver(EventObserver*, EventMask mask = EVENT_MASK_ALL);
   void unregisterObserver(EventObserver*);
+  EventsStats stats() const;
+  // observer ids appear in traces; nullptr when the id was never assigned
+  const char* observerName(uint8_t id) const;
+#if CONFIG_EVENTS_INSTRUMENTATION
+  // one line per queue-wait and per-observer notice() histogram, bucket
+  // counts in log2 microseconds; returns the length written, truncated to
+  // len
+  size_t formatHistograms(char* buf, size_t len) const;
+#endif
 
   private:
   void postEvent(const Event& theEvent);
@@ -0,0 +1,63 @@
+#ifndef _RATE_POLICY_H_INCLUDED_
+#define _RATE_POLICY_H_INCLUDED_
+
+#include <stdint.h>
+
+// How often a consumer wants to hear about a changing value, in time units
+// rather than in calls, so the outcome does not depend on how often a sensor
+// driver happens to report.
+template <typename T> struct RatePolicy {
+  T deadband; // smaller changes are not worth passing on
+  T urgent; // changes this large pass even within min_interval; 0 disables
+  uint32_t min_interval_ms; // at most one value per interval
+  uint32_t max_interval_ms; // pass unchanged values this often; 0 disables
+};
+
+// Applies a RatePolicy to the successive values of one channel. Time is
+// given by the caller, in microseconds, e.g. from esp_timer_get_time().
+template <typename T> class RateLimiter {
+  public:
+  RateLimiter() = default; // passes every change
+  RateLimiter(const RatePolicy<T>& policy)
+      : _policy(policy)
+  {
+  }
+
+  bool shouldPass(T x, int64_t now_us)
+  {
+    if (_has_last && !due(x, now_us - _last_us)) {
+      return false;
+    }
+    _last = x;
+    _last_us = now_us;
+    _has_last = true;
+    return true;
+  }
+
+  // makes the next value pass whatever it is, e.g. after a reconnect
+  void reset() { _has_last = false; }
+
+  const RatePolicy<T>& policy() const { return _policy; }
+
+  private:
+  bool due(T x, int64_t elapsed_us) const
+  {
+    T delta = x > _last ? x - _last : _last - x;
+    if (_policy.max_interval_ms
+        && elapsed_us >= (int64_t)_policy.max_interval_ms * 1000) {
+      return true;
+    }
+    if (_policy.urgent > 0 && delta >= _policy.urgent) {
+      return true;
+    }
+    return elapsed_us >= (int64_t)_policy.min_interval_ms * 1000
+        && delta >= _policy.deadband && delta > 0;
+  }
+
+  RatePolicy<T> _policy {};
+  T _last {};
+  int64_t _last_us = 0;
+  bool _has_last = false;
+};
+
+#endif /* ifndef _RATE_POLICY_H_INCLUDED_ */
@@ -0,0 +1,254 @@
+
+#include "broker_list.h"
+#include <atomic>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <fcntl.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <lwip/dns.h>
+#include <lwip/tcpip.h>
+#include <netinet/in.h>
+#include <new>
+#include <nvs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static const char* TAG = "BROKERS";
+static const char* NVS_NAMESPACE = "mqtt";
+static const char* NVS_KEY = "brokers";
+
+void BrokerList::begin()
+{
+  size_t len = sizeof(_storage);
+  nvs_handle_t nvs;
+  bool loaded = false;
+  if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &nvs) == ESP_OK) {
+    loaded = nvs_get_str(nvs, NVS_KEY, _storage, &len) == ESP_OK
+        && _storage[0] != 0;
+    nvs_close(nvs);
+  }
+  if (!loaded) {
+    strncpy(_storage, CONFIG_MQTT_BROKER_URIS, sizeof(_storage) - 1);
+  }
+
+  // split in place on commas, skipping blanks around the URIs
+  _count = 0;
+  char* p = _storage;
+  while (*p && _count < MAX_BROKERS) {
+    while (*p == ' ') {
+      p++;
+    }
+    char* end = strchr(p, ',');
+    char* next = end ? end + 1 : p + strlen(p);
+    if (end == nullptr) {
+      end = next;
+    }
+    while (end > p && end[-1] == ' ') {
+      end--;
+    }
+    if (end > p) {
+      *end = 0;
+      _uris[_count++] = p;
+    }
+    p = next;
+  }
+  if (_count == 0) {
+    _uris[_count++] = "mqtt://bb-master";
+  }
+  _current = 0;
+  _failures = 0;
+  for (size_t i = 0; i < _count; i++) {
+    ESP_LOGI(TAG, "%s broker %u: %s", loaded ? "NVS" : "Kconfig", i,
+        _uris[i]);
+  }
+}
+
+bool BrokerList::storeOverride(const char* uris, size_t len)
+{
+  char value[sizeof(_storage)];
+  if (len >= sizeof(value)) {
+    return false;
+  }
+  memcpy(value, uris, len);
+  value[len] = 0;
+  nvs_handle_t nvs;
+  if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &nvs) != ESP_OK) {
+    return false;
+  }
+  esp_err_t err
+      = len ? nvs_set_str(nvs, NVS_KEY, value) : nvs_erase_key(nvs, NVS_KEY);
+  if (err == ESP_OK || err == ESP_ERR_NVS_NOT_FOUND) {
+    err = nvs_commit(nvs);
+  }
+  nvs_close(nvs);
+  return err == ESP_OK;
+}
+
+void BrokerList::selectReachable(int timeout_ms)
+{
+  for (size_t i = 0; i < _count; i++) {
+    if (probeBroker(_uris[i], timeout_ms)) {
+      select(i);
+      return;
+    }
+  }
+  select(0);
+}
+
+bool BrokerList::failed()
+{
+  if (_count < 2 || ++_failures < CONFIG_MQTT_FAILOVER_ATTEMPTS) {
+    return false;
+  }
+  select((_current + 1) % _count);
+  return true;
+}
+
+// getaddrinfo() waits for all of lwIP's DNS retries, whatever the probe
+// timeout, so the lookup is handed to the resolver in the tcpip thread and
+// given up on after the timeout instead. Each lookup has a context of its
+// own, shared by the prober and the tcpip thread and freed by whichever of
+// them is done with it last: the answer to a lookup given up on still comes,
+// and lands there rather than in the next lookup.
+struct DnsLookup {
+  char name[64];
+  SemaphoreHandle_t done;
+  ip_addr_t addr;
+  bool found;
+  std::atomic<int> refs;
+};
+
+static void release(DnsLookup* lookup)
+{
+  if (--lookup->refs == 0) {
+    vSemaphoreDelete(lookup->done);
+    delete lookup;
+  }
+}
+
+static void dnsAnswer(const char*, const ip_addr_t* addr, void* arg)
+{
+  auto lookup = static_cast<DnsLookup*>(arg);
+  lookup->found = addr != nullptr;
+  if (lookup->found) {
+    lookup->addr = *addr;
+  }
+  xSemaphoreGive(lookup->done);
+  release(lookup);
+}
+
+static void dnsStart(void* arg)
+{
+  auto lookup = static_cast<DnsLookup*>(arg);
+  ip_addr_t addr;
+  err_t err = dns_gethostbyname_addrtype(
+      lookup->name, &addr, dnsAnswer, lookup, LWIP_DNS_ADDRTYPE_IPV4);
+  // IP literals and cached names are answered right away
+  if (err == ERR_OK) {
+    dnsAnswer(lookup->name, &addr, lookup);
+  } else if (err != ERR_INPROGRESS) {
+    dnsAnswer(lookup->name, nullptr, lookup);
+  }
+}
+
+static bool resolve(const char* name, ip_addr_t& addr, int timeout_ms)
+{
+  auto lookup = new (std::nothrow) DnsLookup {};
+  if (lookup == nullptr) {
+    return false;
+  }
+  lookup->done = xSemaphoreCreateBinary();
+  if (lookup->done == nullptr) {
+    delete lookup;
+    return false;
+  }
+  strncpy(lookup->name, name, sizeof(lookup->name) - 1);
+  lookup->refs = 2;
+  if (tcpip_callback(dnsStart, lookup) != ERR_OK) {
+    lookup->refs = 1;
+    release(lookup);
+    return false;
+  }
+  bool found = xSemaphoreTake(lookup->done, pdMS_TO_TICKS(timeout_ms) + 1)
+          == pdTRUE
+      && lookup->found;
+  if (found) {
+    addr = lookup->addr;
+  }
+  release(lookup);
+  return found;
+}
+
+bool probeBroker(const char* uri, int timeout_ms)
+{
+  const char* host = strstr(uri, "://");
+  const char* port = "1883";
+  if (host == nullptr) {
+    host = uri;
+  } else {
+    if (strncmp(uri, "mqtts", 5) == 0) {
+      port = "8883";
+    }
+    host += 3;
+  }
+  char name[64];
+  size_t len = strcspn(host, ":/");
+  if (len == 0 || len >= sizeof(name)) {
+    return false;
+  }
+  memcpy(name, host, len);
+  name[len] = 0;
+  char portBuf[8];
+  if (host[len] == ':') {
+    size_t n = strcspn(host + len + 1, "/");
+    if (n == 0 || n >= sizeof(portBuf)) {
+      return false;
+    }
+    memcpy(portBuf, host + len + 1, n);
+    portBuf[n] = 0;
+    port = portBuf;
+  }
+
+  int64_t start_us = esp_timer_get_time();
+  ip_addr_t addr;
+  if (!resolve(name, addr, timeout_ms)) {
+    ESP_LOGW(TAG, "Cannot resolve %s", name);
+    return false;
+  }
+  // what is left of the timeout is for the connection
+  timeout_ms -= (int)((esp_timer_get_time() - start_us) / 1000);
+  struct sockaddr_in sa = {};
+  sa.sin_family = AF_INET;
+  sa.sin_port = htons((uint16_t)atoi(port));
+  sa.sin_addr.s_addr = ip_2_ip4(&addr)->addr;
+  bool reachable = false;
+  int s = socket(AF_INET, SOCK_STREAM, 0);
+  if (s >= 0 && timeout_ms > 0) {
+    fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK);
+    if (connect(s, (struct sockaddr*)&sa, sizeof(sa)) == 0) {
+      reachable = true;
+    } else {
+      fd_set writable;
+      FD_ZERO(&writable);
+      FD_SET(s, &writable);
+      struct timeval tv = { .tv_sec = timeout_ms / 1000,
+        .tv_usec = (timeout_ms % 1000) * 1000 };
+      int err = 0;
+      socklen_t errlen = sizeof(err);
+      reachable = select(s + 1, nullptr, &writable, nullptr, &tv) > 0
+          && getsockopt(s, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0
+          && err == 0;
+    }
+  }
+  if (s >= 0) {
+    close(s);
+  }
+  ESP_LOGI(TAG, "Probe of %s:%s: %s", name, port,
+      reachable ? "reachable" : "unreachable");
+  return reachable;
+}
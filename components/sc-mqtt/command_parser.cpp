@@ -0,0 +1,202 @@
+
+#include "command_parser.h"
+#include <algorithm>
+#include <charconv>
+
+static bool isBlank(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+static char lower(char c) { return c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c; }
+
+static bool equalsIgnoreCase(std::string_view word, const char* keyword)
+{
+  size_t i = 0;
+  for (; i < word.size() && keyword[i]; i++) {
+    if (lower(word[i]) != lower(keyword[i])) {
+      return false;
+    }
+  }
+  return i == word.size() && keyword[i] == 0;
+}
+
+bool parseInt(std::string_view word, int32_t& value)
+{
+  const char* first = word.data();
+  const char* last = first + word.size();
+  // from_chars takes a minus sign but no plus sign
+  if (first < last && *first == '+' && last - first > 1 && first[1] != '-') {
+    first++;
+  }
+  auto [ptr, ec] = std::from_chars(first, last, value);
+  return ec == std::errc() && ptr == last;
+}
+
+// The significant digits are gathered in an integer and scaled once by a
+// power of ten, which is within one ulp of strtof for the values commands
+// carry, without the locale and errno handling of the C library.
+bool parseFloat(std::string_view word, float& value)
+{
+  constexpr uint32_t MANTISSA_MAX = 100000000; // 9 digits fit in 32 bits
+  const char* p = word.data();
+  const char* end = p + word.size();
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = *p++ == '-';
+  }
+  uint32_t mantissa = 0;
+  int32_t exponent = 0;
+  bool digits = false;
+  for (; p < end && isDigit(*p); p++) {
+    digits = true;
+    if (mantissa < MANTISSA_MAX) {
+      mantissa = mantissa * 10 + (*p - '0');
+    } else {
+      exponent++;
+    }
+  }
+  if (p < end && *p == '.') {
+    for (p++; p < end && isDigit(*p); p++) {
+      digits = true;
+      if (mantissa < MANTISSA_MAX) {
+        mantissa = mantissa * 10 + (*p - '0');
+        exponent--;
+      }
+    }
+  }
+  if (!digits) {
+    return false;
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    int32_t e;
+    if (!parseInt(std::string_view(p + 1, end - p - 1), e)) {
+      return false;
+    }
+    // the digits may have moved the exponent as far the other way, so only
+    // clamp once both are summed
+    exponent += std::clamp<int32_t>(e, -1000000, 1000000);
+    p = end;
+  }
+  if (p != end) {
+    return false;
+  }
+  if (exponent > 100 || exponent < -100) {
+    if (mantissa != 0 && exponent > 0) {
+      return false;
+    }
+    exponent = exponent > 0 ? 100 : -100;
+  }
+
+  static constexpr float POW10[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f,
+    1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+  float v = (float)mantissa;
+  for (; exponent > 10; exponent -= 10) {
+    v *= POW10[10];
+  }
+  for (; exponent < -10; exponent += 10) {
+    v /= POW10[10];
+  }
+  if (exponent > 0) {
+    v *= POW10[exponent];
+  } else if (exponent < 0) {
+    v /= POW10[-exponent];
+  }
+  if (v > 3.4028235e38f) {
+    return false;
+  }
+  value = negative ? -v : v;
+  return true;
+}
+
+CommandResult parseCommand(
+    std::string_view data, const CommandGrammar& grammar, CommandArgs& args)
+{
+  const char* p = data.data();
+  const char* end = p + data.size();
+  args.count = 0;
+  while (true) {
+    while (p < end && isBlank(*p)) {
+      p++;
+    }
+    if (p == end) {
+      break;
+    }
+    const char* start = p;
+    while (p < end && !isBlank(*p)) {
+      p++;
+    }
+    uint8_t n = args.count;
+    if (n == grammar.count) {
+      return { COMMAND_TOO_MANY_WORDS, n };
+    }
+    std::string_view word(start, p - start);
+    const CommandArgSpec& spec = grammar.args[n];
+    CommandArgs::Value& arg = args.values[n];
+    switch (spec.type) {
+    case COMMAND_ARG_FLOAT:
+      if (!parseFloat(word, arg.number)) {
+        return { COMMAND_BAD_NUMBER, n };
+      }
+      break;
+    case COMMAND_ARG_INT:
+      if (!parseInt(word, arg.integer)) {
+        return { COMMAND_BAD_NUMBER, n };
+      }
+      break;
+    case COMMAND_ARG_KEYWORD: {
+      uint8_t k = 0;
+      while (k < spec.keyword_count
+          && !equalsIgnoreCase(word, spec.keywords[k])) {
+        k++;
+      }
+      if (k == spec.keyword_count) {
+        return { COMMAND_BAD_KEYWORD, n };
+      }
+      arg.keyword = k;
+      break;
+    }
+    }
+    args.count++;
+  }
+  if (args.count < grammar.count && !grammar.args[args.count].optional) {
+    return { COMMAND_TOO_FEW_WORDS, args.count };
+  }
+  return { COMMAND_OK, 0 };
+}
+
+const char* commandStatusName(CommandStatus status)
+{
+  switch (status) {
+  case COMMAND_OK:
+    return "ok";
+  case COMMAND_TOO_FEW_WORDS:
+    return "missing_argument";
+  case COMMAND_TOO_MANY_WORDS:
+    return "too_many_arguments";
+  case COMMAND_BAD_NUMBER:
+    return "bad_number";
+  case COMMAND_BAD_KEYWORD:
+    return "unknown_keyword";
+  }
+  return "unknown";
+}
+
+const char* commandStatusText(CommandStatus status)
+{
+  switch (status) {
+  case COMMAND_OK:
+    return "ok";
+  case COMMAND_TOO_FEW_WORDS:
+    return "missing arguments";
+  case COMMAND_TOO_MANY_WORDS:
+    return "too many arguments";
+  case COMMAND_BAD_NUMBER:
+    return "bad number";
+  case COMMAND_BAD_KEYWORD:
+    return "unknown keyword";
+  }
+  return "?";
+}
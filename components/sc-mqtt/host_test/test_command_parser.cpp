@@ -0,0 +1,280 @@
+// Well-formed and malformed command payloads against grammars like those of
+// the handlers in mqtt.cpp: the status and offending word of each, the
+// values of some, and the float parser against strtof. With --bench, times
+// parseCommand against the copy and sscanf it replaced.
+
+#include "command_parser.h"
+#include <chrono>
+#include <cmath>
+#include <ctype.h>
+#include <random>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+using namespace std::literals;
+
+static constexpr const char* ON_OFF[] = { "on", "off" };
+static constexpr const char* SOUNDS[] = { "alert", "warning", "doorbell" };
+static constexpr CommandGrammar FLOATS = commandGrammar(
+    floatArg(), floatArg(), floatArg());
+static constexpr CommandGrammar SOUND = commandGrammar(
+    keywordArg(SOUNDS), optional(keywordArg(ON_OFF)));
+static constexpr CommandGrammar ON_OFF_GRAMMAR = commandGrammar(
+    keywordArg(ON_OFF));
+static constexpr CommandGrammar INTS = commandGrammar(
+    intArg(), optional(intArg()));
+
+struct Case {
+  std::string payload;
+  const CommandGrammar* grammar;
+  CommandStatus status;
+  uint8_t word = 0; // when status is not COMMAND_OK
+};
+
+static int failures = 0;
+
+static void fail(const char* what, std::string_view payload)
+{
+  failures++;
+  printf("FAIL %s: \"", what);
+  for (char c : payload.substr(0, 64)) {
+    if (isprint((unsigned char)c)) {
+      putchar(c);
+    } else {
+      printf("\\x%02x", (unsigned char)c);
+    }
+  }
+  printf("%s\"\n", payload.size() > 64 ? "..." : "");
+}
+
+static std::vector<Case> corpus()
+{
+  return {
+    // well-formed
+    { "21.5 45 120", &FLOATS, COMMAND_OK },
+    { "  21.5\t45\r\n120 ", &FLOATS, COMMAND_OK },
+    { "-1e2 +3.5 .5", &FLOATS, COMMAND_OK },
+    { "1. 2 3", &FLOATS, COMMAND_OK },
+    { "1e-999 2 3", &FLOATS, COMMAND_OK },
+    // zero with an exponent beyond the table of powers of ten
+    { "0e11 0e-11 0.0e99", &FLOATS, COMMAND_OK },
+    { "-0E-20 0.0e50 0e100", &FLOATS, COMMAND_OK },
+    { "alert on", &SOUND, COMMAND_OK },
+    { "ALERT Off", &SOUND, COMMAND_OK },
+    { "doorbell", &SOUND, COMMAND_OK },
+    { "12", &INTS, COMMAND_OK },
+    { "+12 -7", &INTS, COMMAND_OK },
+    { "-2147483648", &INTS, COMMAND_OK },
+    // missing and extra words
+    { "", &FLOATS, COMMAND_TOO_FEW_WORDS, 0 },
+    { "1 2", &FLOATS, COMMAND_TOO_FEW_WORDS, 2 },
+    { "   ", &SOUND, COMMAND_TOO_FEW_WORDS, 0 },
+    { "1 2 3 4", &FLOATS, COMMAND_TOO_MANY_WORDS, 3 },
+    { "alert on now", &SOUND, COMMAND_TOO_MANY_WORDS, 2 },
+    { "on off", &ON_OFF_GRAMMAR, COMMAND_TOO_MANY_WORDS, 1 },
+    // truncated numbers
+    { "21.5 45.", &FLOATS, COMMAND_TOO_FEW_WORDS, 2 },
+    { "21.5 45 1e", &FLOATS, COMMAND_BAD_NUMBER, 2 },
+    { "21.5 45 1e+", &FLOATS, COMMAND_BAD_NUMBER, 2 },
+    { "21.5 45 2e-", &FLOATS, COMMAND_BAD_NUMBER, 2 },
+    { "21.5 45 -", &FLOATS, COMMAND_BAD_NUMBER, 2 },
+    { "21.5 45 +.", &FLOATS, COMMAND_BAD_NUMBER, 2 },
+    { ". 2 3", &FLOATS, COMMAND_BAD_NUMBER, 0 },
+    { "+", &INTS, COMMAND_BAD_NUMBER, 0 },
+    { "12 -", &INTS, COMMAND_BAD_NUMBER, 1 },
+    // malformed numbers
+    { "1 2 x", &FLOATS, COMMAND_BAD_NUMBER, 2 },
+    { "1,5 2 3", &FLOATS, COMMAND_BAD_NUMBER, 0 },
+    { "+-1 2 3", &FLOATS, COMMAND_BAD_NUMBER, 0 },
+    { "--1 2 3", &FLOATS, COMMAND_BAD_NUMBER, 0 },
+    { "1..2 2 3", &FLOATS, COMMAND_BAD_NUMBER, 0 },
+    { "1e5.5 2 3", &FLOATS, COMMAND_BAD_NUMBER, 0 },
+    { "1e39 2 3", &FLOATS, COMMAND_BAD_NUMBER, 0 },
+    { "1e999999999999 2 3", &FLOATS, COMMAND_BAD_NUMBER, 0 },
+    { "nan 2 3", &FLOATS, COMMAND_BAD_NUMBER, 0 },
+    { "inf 2 3", &FLOATS, COMMAND_BAD_NUMBER, 0 },
+    { "0x10 2 3", &FLOATS, COMMAND_BAD_NUMBER, 0 },
+    { "2147483648", &INTS, COMMAND_BAD_NUMBER, 0 },
+    { "1.5", &INTS, COMMAND_BAD_NUMBER, 0 },
+    { "+-3", &INTS, COMMAND_BAD_NUMBER, 0 },
+    { "12abc", &INTS, COMMAND_BAD_NUMBER, 0 },
+    // unknown keywords
+    { "alarm on", &SOUND, COMMAND_BAD_KEYWORD, 0 },
+    { "alerton", &SOUND, COMMAND_BAD_KEYWORD, 0 },
+    { "aler on", &SOUND, COMMAND_BAD_KEYWORD, 0 },
+    { "alert onn", &SOUND, COMMAND_BAD_KEYWORD, 1 },
+    // overlong tokens
+    { std::string(300, '9') + " 2 3", &FLOATS, COMMAND_BAD_NUMBER, 0 },
+    { std::string(1000, '0') + "1 2 3", &FLOATS, COMMAND_OK },
+    { "0." + std::string(300, '0') + "1 2 3", &FLOATS, COMMAND_OK },
+    { "1" + std::string(400, '0') + "e-400 2 3", &FLOATS, COMMAND_OK },
+    { std::string(40, '1'), &INTS, COMMAND_BAD_NUMBER, 0 },
+    { std::string(5000, 'a'), &SOUND, COMMAND_BAD_KEYWORD, 0 },
+    { std::string(2000, ' ') + "doorbell", &SOUND, COMMAND_OK },
+    // embedded NULs are not blanks
+    { "1\0 2 3"s, &FLOATS, COMMAND_BAD_NUMBER, 0 },
+    { "1 2 3\0"s, &FLOATS, COMMAND_BAD_NUMBER, 2 },
+    { "12\0"s, &INTS, COMMAND_BAD_NUMBER, 0 },
+    { "\0"s, &SOUND, COMMAND_BAD_KEYWORD, 0 },
+    { "alert\0 on"s, &SOUND, COMMAND_BAD_KEYWORD, 0 },
+    { "on\0"s, &ON_OFF_GRAMMAR, COMMAND_BAD_KEYWORD, 0 },
+    // non-ASCII: other digits, blanks and letters are not ours
+    { "\xef\xbc\x92\xef\xbc\x91 2 3", &FLOATS, COMMAND_BAD_NUMBER, 0 },
+    { "\xd9\xa1\xd9\xa2", &INTS, COMMAND_BAD_NUMBER, 0 },
+    { "21\xc2\xa0" "5 2 3", &FLOATS, COMMAND_BAD_NUMBER, 0 },
+    { "1e\xe2\x88\x92" "5 2 3", &FLOATS, COMMAND_BAD_NUMBER, 0 },
+    { "\xff\xfe 2 3", &FLOATS, COMMAND_BAD_NUMBER, 0 },
+    { "al\xc3\xa9rt on", &SOUND, COMMAND_BAD_KEYWORD, 0 },
+    { "ALERT \xc3\x96N", &SOUND, COMMAND_BAD_KEYWORD, 1 },
+  };
+}
+
+static void checkCorpus()
+{
+  auto cases = corpus();
+  for (const auto& c : cases) {
+    CommandArgs args;
+    CommandResult result = parseCommand(c.payload, *c.grammar, args);
+    if (result.status != c.status
+        || (c.status != COMMAND_OK && result.word != c.word)) {
+      char what[96];
+      snprintf(what, sizeof(what), "want %s at word %u, got %s at word %u",
+          commandStatusName(c.status), c.word,
+          commandStatusName(result.status), result.word);
+      fail(what, c.payload);
+    }
+  }
+  printf("corpus: %zu payloads\n", cases.size());
+}
+
+// the ack contract: these go out on barlog/<host>/ack and scripts match them
+static void checkStatusNames()
+{
+  const struct {
+    CommandStatus status;
+    const char* name;
+  } names[] = {
+    { COMMAND_OK, "ok" },
+    { COMMAND_TOO_FEW_WORDS, "missing_argument" },
+    { COMMAND_TOO_MANY_WORDS, "too_many_arguments" },
+    { COMMAND_BAD_NUMBER, "bad_number" },
+    { COMMAND_BAD_KEYWORD, "unknown_keyword" },
+  };
+  for (const auto& n : names) {
+    if (strcmp(commandStatusName(n.status), n.name) != 0) {
+      fail("status name", n.name);
+    }
+  }
+}
+
+static void checkValues()
+{
+  CommandArgs args;
+  auto parses = [&](std::string_view payload, const CommandGrammar& grammar) {
+    return parseCommand(payload, grammar, args).status == COMMAND_OK;
+  };
+  auto check = [](bool ok, std::string_view payload) {
+    if (!ok) {
+      fail("values", payload);
+    }
+  };
+  // the words must not need a NUL after them
+  std::string_view view = "1 2 3GARBAGE"sv.substr(0, 5);
+  check(parses(view, FLOATS) && args.number(2) == 3.0f, view);
+  check(parses("-1e2 +3.5 .5", FLOATS) && args.number(0) == -100.0f
+          && args.number(1) == 3.5f && args.number(2) == 0.5f,
+      "-1e2 +3.5 .5");
+  check(parses("21.5 45.25 120", FLOATS) && args.number(0) == 21.5f
+          && args.number(1) == 45.25f && args.number(2) == 120.0f,
+      "21.5 45.25 120");
+  check(parses("1e-999 2 3", FLOATS) && args.number(0) == 0.0f,
+      "1e-999 2 3");
+  check(parses("-0E-20 0e11 0.0e99", FLOATS) && args.number(0) == 0.0f
+          && std::signbit(args.number(0)) && args.number(1) == 0.0f
+          && args.number(2) == 0.0f,
+      "-0E-20 0e11 0.0e99");
+  std::string longOne = "1" + std::string(400, '0') + "e-400 2 3";
+  check(parses(longOne, FLOATS) && args.number(0) == 1.0f, longOne);
+  check(parses("+12 -7", INTS) && args.count == 2 && args.integer(0) == 12
+          && args.integer(1) == -7,
+      "+12 -7");
+  check(parses("-2147483648", INTS) && args.count == 1
+          && args.integer(0) == INT32_MIN,
+      "-2147483648");
+  check(parses("ALERT Off", SOUND) && args.count == 2
+          && args.keyword(0) == 0 && args.keyword(1) == 1,
+      "ALERT Off");
+  check(parses("doorbell", SOUND) && args.count == 1 && args.keyword(0) == 2,
+      "doorbell");
+}
+
+// parseFloat scales once by a power of ten, so it may be one ulp away from
+// the correctly rounded strtof, never more
+static void checkAccuracy()
+{
+  constexpr int COUNT = 100000;
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> values(-2000.0f, 2000.0f);
+  int ulp = 0;
+  for (int i = 0; i < COUNT; i++) {
+    char word[32];
+    snprintf(word, sizeof(word), "%.*f", (int)(rng() % 7), values(rng));
+    float parsed;
+    float reference = strtof(word, nullptr);
+    if (!parseFloat(word, parsed)) {
+      fail("parseFloat", word);
+    } else if (parsed != reference) {
+      if (std::nextafter(parsed, reference) == reference) {
+        ulp++;
+      } else {
+        fail("more than one ulp from strtof", word);
+      }
+    }
+  }
+  printf("accuracy: %d values, %d one ulp off strtof\n", COUNT, ulp);
+}
+
+static void bench()
+{
+  constexpr int COUNT = 2000000;
+  constexpr const char* PAYLOAD = "21.5 45.25 120";
+  volatile float sink = 0;
+  auto t0 = std::chrono::steady_clock::now();
+  for (int i = 0; i < COUNT; i++) {
+    CommandArgs args;
+    parseCommand(PAYLOAD, FLOATS, args);
+    sink = sink + args.number(0);
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  for (int i = 0; i < COUNT; i++) {
+    // what the handlers did before: copy to a C string, then sscanf
+    char copy[128];
+    strncpy(copy, PAYLOAD, sizeof(copy));
+    float t, rh, iaq;
+    sscanf(copy, "%f %f %f", &t, &rh, &iaq);
+    sink = sink + t;
+  }
+  auto t2 = std::chrono::steady_clock::now();
+  auto ns = [](auto d) {
+    return std::chrono::duration<double, std::nano>(d).count() / COUNT;
+  };
+  printf("\"%s\": parseCommand %.0f ns, copy and sscanf %.0f ns\n", PAYLOAD,
+      ns(t1 - t0), ns(t2 - t1));
+}
+
+int main(int argc, char** argv)
+{
+  if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+    bench();
+    return 0;
+  }
+  checkCorpus();
+  checkStatusNames();
+  checkValues();
+  checkAccuracy();
+  printf("%d failures\n", failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,113 @@
+// TopicTable, the dispatch of MQTT_EVENT_DATA to mqttSubscriptions: topics
+// match exactly, never by prefix, and need no NUL after them. With --bench,
+// times a dispatch against the strncmp() scan it replaced at 10 and 100
+// subscriptions.
+
+#include "topic_table.h"
+#include <chrono>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+struct Subscription {
+  const char* TOPIC;
+};
+
+static constexpr Subscription SUBSCRIPTIONS[] = {
+  { "cmd/barlog/night_mode" },
+  { "cmd/host/ota" },
+  { "cmd/host/ota_x" },
+  { "cmd/host/lights" },
+  { "state/host/air_quality" },
+};
+static constexpr TopicTable TABLE(SUBSCRIPTIONS);
+
+static int failures = 0;
+
+static void fail(const char* what, const char* topic)
+{
+  failures++;
+  printf("FAIL %s: %s\n", what, topic);
+}
+
+static void checkLookups()
+{
+  for (size_t i = 0; i < sizeof(SUBSCRIPTIONS) / sizeof(SUBSCRIPTIONS[0]);
+       i++) {
+    const char* topic = SUBSCRIPTIONS[i].TOPIC;
+    if (TABLE.find(topic, strlen(topic)) != (int)i) {
+      fail("subscribed topic", topic);
+    }
+  }
+  const char* misses[] = { "cmd/host/ot", "cmd/host/ota_", "cmd/host/otaX",
+    "cmd/host/lights/x", "", "cmd/barlog/night_modes" };
+  for (const char* topic : misses) {
+    if (TABLE.find(topic, strlen(topic)) != -1) {
+      fail("topic not subscribed", topic);
+    }
+  }
+  // MQTT_EVENT_DATA topics are not NUL terminated
+  const char* data = "cmd/host/ota_xyz";
+  if (TABLE.find(data, 12) != 1 || TABLE.find(data, 14) != 2) {
+    fail("topic followed by more bytes", data);
+  }
+}
+
+// what mqtt_event_handler() did before: a strncmp() of each subscription
+// against the event's topic_len bytes
+static int linearFind(
+    const std::vector<Subscription>& subs, const char* topic, size_t len)
+{
+  for (size_t i = 0; i < subs.size(); i++) {
+    if (strncmp(subs[i].TOPIC, topic, len) == 0) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+template <size_t N> static void benchAt()
+{
+  constexpr int ROUNDS = 200000;
+  std::vector<std::string> topics;
+  for (size_t i = 0; i < N; i++) {
+    topics.push_back("cmd/host/command_" + std::to_string(i));
+  }
+  Subscription subs[N];
+  for (size_t i = 0; i < N; i++) {
+    subs[i].TOPIC = topics[i].c_str();
+  }
+  TopicTable<N> table(subs);
+  std::vector<Subscription> list(subs, subs + N);
+
+  volatile int sink = 0;
+  auto t0 = std::chrono::steady_clock::now();
+  for (int r = 0; r < ROUNDS; r++) {
+    const std::string& topic = topics[r % N];
+    sink = sink + table.find(topic.data(), topic.size());
+  }
+  auto t1 = std::chrono::steady_clock::now();
+  for (int r = 0; r < ROUNDS; r++) {
+    const std::string& topic = topics[r % N];
+    sink = sink + linearFind(list, topic.data(), topic.size());
+  }
+  auto t2 = std::chrono::steady_clock::now();
+  auto ns = [](auto d) {
+    return std::chrono::duration<double, std::nano>(d).count() / ROUNDS;
+  };
+  printf("%zu subscriptions: TopicTable %.0f ns, strncmp scan %.0f ns\n", N,
+      ns(t1 - t0), ns(t2 - t1));
+}
+
+int main(int argc, char** argv)
+{
+  if (argc > 1 && strcmp(argv[1], "--bench") == 0) {
+    benchAt<10>();
+    benchAt<100>();
+    return 0;
+  }
+  checkLookups();
+  printf("%d failures\n", failures);
+  return failures ? 1 : 0;
+}
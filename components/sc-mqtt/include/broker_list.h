@@ -0,0 +1,52 @@
+#ifndef _BROKER_LIST_H_
+#define _BROKER_LIST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The brokers to connect to, in order of preference: the comma separated
+// CONFIG_MQTT_BROKER_URIS, unless a list was stored in NVS with
+// storeOverride(). The first one is the primary; the others are only used
+// while it cannot be reached.
+class BrokerList {
+  public:
+  static constexpr size_t MAX_BROKERS = 4;
+
+  void begin();
+  // stores a comma separated list used from the next begin() on; an empty
+  // one removes the override
+  static bool storeOverride(const char* uris, size_t len);
+
+  size_t count() const { return _count; }
+  size_t index() const { return _current; }
+  const char* current() const { return _uris[_current]; }
+  const char* primary() const { return _uris[0]; }
+  bool onPrimary() const { return _current == 0; }
+
+  // makes the first broker answering a probe the current one
+  void selectReachable(int timeout_ms);
+  // counts a failed connection or a lost one, and moves on to the next
+  // broker after CONFIG_MQTT_FAILOVER_ATTEMPTS in a row; returns whether
+  // it did
+  bool failed();
+  void connected() { _failures = 0; }
+  void select(size_t index)
+  {
+    _current = index < _count ? index : 0;
+    _failures = 0;
+  }
+
+  private:
+  char _storage[256] = {};
+  const char* _uris[MAX_BROKERS] = {};
+  size_t _count = 0;
+  size_t _current = 0;
+  uint32_t _failures = 0;
+};
+
+// Whether a TCP connection to the host and port of an mqtt:// or mqtts://
+// URI can be opened within timeout_ms, name lookup included; blocks the
+// caller meanwhile.
+bool probeBroker(const char* uri, int timeout_ms);
+
+#endif /* ifndef _BROKER_LIST_H_ */
@@ -0,0 +1,98 @@
+#ifndef _COMMAND_PARSER_H_
+#define _COMMAND_PARSER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+
+// Commands are words separated by blanks. A handler declares what each word
+// must be in a CommandGrammar, and parseCommand() checks and converts the
+// whole payload in one pass, straight from the MQTT client's buffer: no
+// sscanf, no locale, no allocation, no NUL terminator needed.
+
+constexpr size_t COMMAND_MAX_ARGS = 4;
+
+enum CommandArgType : uint8_t {
+  COMMAND_ARG_FLOAT, // [+-]digits[.digits][e[+-]digits]
+  COMMAND_ARG_INT, // [+-]digits, in 32 bits
+  COMMAND_ARG_KEYWORD, // one of a fixed set of words, whatever their case
+};
+
+struct CommandArgSpec {
+  CommandArgType type;
+  bool optional; // only at the end of a grammar
+  const char* const* keywords;
+  uint8_t keyword_count;
+};
+
+constexpr CommandArgSpec floatArg()
+{
+  return { COMMAND_ARG_FLOAT, false, nullptr, 0 };
+}
+constexpr CommandArgSpec intArg()
+{
+  return { COMMAND_ARG_INT, false, nullptr, 0 };
+}
+// the argument is the index of the word matched in words
+template <size_t N>
+constexpr CommandArgSpec keywordArg(const char* const (&words)[N])
+{
+  return { COMMAND_ARG_KEYWORD, false, words, N };
+}
+constexpr CommandArgSpec optional(CommandArgSpec spec)
+{
+  spec.optional = true;
+  return spec;
+}
+
+struct CommandGrammar {
+  CommandArgSpec args[COMMAND_MAX_ARGS];
+  uint8_t count;
+};
+
+template <typename... Specs>
+constexpr CommandGrammar commandGrammar(Specs... specs)
+{
+  static_assert(sizeof...(specs) <= COMMAND_MAX_ARGS, "too many arguments");
+  return { { specs... }, sizeof...(specs) };
+}
+
+struct CommandArgs {
+  union Value {
+    float number;
+    int32_t integer;
+    uint8_t keyword;
+  };
+  Value values[COMMAND_MAX_ARGS];
+  uint8_t count; // words given, optional ones included
+
+  float number(size_t n) const { return values[n].number; }
+  int32_t integer(size_t n) const { return values[n].integer; }
+  uint8_t keyword(size_t n) const { return values[n].keyword; }
+};
+
+enum CommandStatus : uint8_t {
+  COMMAND_OK,
+  COMMAND_TOO_FEW_WORDS,
+  COMMAND_TOO_MANY_WORDS,
+  COMMAND_BAD_NUMBER,
+  COMMAND_BAD_KEYWORD,
+};
+
+struct CommandResult {
+  CommandStatus status;
+  uint8_t word; // index of the offending word
+};
+
+CommandResult parseCommand(
+    std::string_view data, const CommandGrammar& grammar, CommandArgs& args);
+// a stable snake_case token, as sent in command acks
+const char* commandStatusName(CommandStatus status);
+// the same for a human, as logged
+const char* commandStatusText(CommandStatus status);
+
+// The whole of word must be a number; false when it is not, or out of range
+bool parseFloat(std::string_view word, float& value);
+bool parseInt(std::string_view word, int32_t& value);
+
+#endif /* ifndef _COMMAND_PARSER_H_ */
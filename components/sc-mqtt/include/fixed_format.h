@@ -0,0 +1,72 @@
+#ifndef _FIXED_FORMAT_H_
+#define _FIXED_FORMAT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Number formatting for MQTT payloads that stays clear of newlib's printf:
+// integer divisions only, and a single float multiply to scale a reading to
+// fixed point. Both write a NUL terminated string and return its length.
+
+// buf must hold 11 chars
+inline size_t formatUnsigned(char* buf, uint32_t value)
+{
+  char digits[10];
+  size_t n = 0;
+  do {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  for (size_t i = 0; i < n; i++) {
+    buf[i] = digits[n - 1 - i];
+  }
+  buf[n] = 0;
+  return n;
+}
+
+// Like "%.*f" with decimals between 0 and 3, rounding half away from zero
+// in float precision. Values too large to scale into 32 bits come out as
+// "inf", NaN as "nan". buf must hold 13 chars.
+inline size_t formatFixed(char* buf, float value, uint8_t decimals)
+{
+  static constexpr float SCALE[] = { 1.0f, 10.0f, 100.0f, 1000.0f };
+  if (value != value) {
+    memcpy(buf, "nan", 4);
+    return 3;
+  }
+  if (decimals > 3) {
+    decimals = 3;
+  }
+  bool negative = value < 0;
+  float scaled = (negative ? -value : value) * SCALE[decimals] + 0.5f;
+  if (!(scaled < 4294967040.0f)) {
+    memcpy(buf, negative ? "-inf" : "inf", negative ? 5 : 4);
+    return negative ? 4 : 3;
+  }
+  uint32_t fixed = (uint32_t)scaled;
+  // built backwards: decimals, point, integer part, sign
+  char digits[13];
+  size_t n = 0;
+  for (uint8_t d = 0; d < decimals; d++) {
+    digits[n++] = '0' + fixed % 10;
+    fixed /= 10;
+  }
+  if (decimals) {
+    digits[n++] = '.';
+  }
+  do {
+    digits[n++] = '0' + fixed % 10;
+    fixed /= 10;
+  } while (fixed);
+  if (negative) {
+    digits[n++] = '-';
+  }
+  for (size_t i = 0; i < n; i++) {
+    buf[i] = digits[n - 1 - i];
+  }
+  buf[n] = 0;
+  return n;
+}
+
+#endif /* ifndef _FIXED_FORMAT_H_ */
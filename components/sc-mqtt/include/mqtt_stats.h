@@ -0,0 +1,74 @@
+#ifndef _MQTT_STATS_H_
+#define _MQTT_STATS_H_
+
+#include <event_histogram.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if CONFIG_MQTT_STATS
+
+// Health of the link to the broker, published as JSON on
+// barlog/<host>/mqtt_stats, sampled at the int64_t now_us of each call.
+//
+// Sampling costs, on every publish: taking a mutex and writing one slot of
+// a ring of CONFIG_MQTT_STATS_PENDING message ids, plus reading the client's
+// outbox size, a walk of its outbox list under the client lock; on every
+// PUBACK or SUBACK: a linear search of that ring and a histogram increment.
+// Messages still waiting for their ack when the ring wraps are counted as
+// untracked rather than timed. Every counter is updated under the same
+// mutex format() takes, as they are bumped from the client's task and the
+// publishing tasks alike.
+class MqttStats {
+  public:
+  bool begin();
+  // a publish or subscribe was handed to the client, msg_id being what the
+  // client returned; only QoS1 publishes and subscribes get an ack to time
+  void sent(int msg_id, int qos, int outbox_bytes, int64_t now_us);
+  void subscribed(int msg_id, int64_t now_us);
+  // MQTT_EVENT_PUBLISHED and MQTT_EVENT_SUBSCRIBED
+  void acked(int msg_id, int64_t now_us);
+  // MQTT_EVENT_DELETED: a message expired in the outbox before it was acked
+  void expired();
+  void error();
+  void connected(int64_t now_us);
+  void disconnected(int64_t now_us);
+  // total of events the observer inbox dropped, kept by its EventWorker
+  void inboxDropped(uint32_t dropped);
+
+  // writes the JSON document; returns what snprintf would, like snprintf
+  int format(char* buf, size_t len, int64_t now_us);
+
+  private:
+  static constexpr size_t PENDING = CONFIG_MQTT_STATS_PENDING;
+  struct Pending {
+    int msg_id; // 0 when free
+    uint32_t sent_us; // wraps after 71 minutes, longer than any ack takes
+    bool subscribe;
+  };
+  void track(int msg_id, bool subscribe, int64_t now_us);
+
+  SemaphoreHandle_t _lock = nullptr;
+  Pending _pending[PENDING] = {};
+  size_t _next = 0;
+  // enqueue to PUBACK and subscribe to SUBACK times, in microseconds
+  Log2Histogram<24> _puback_us;
+  Log2Histogram<24> _suback_us;
+  uint32_t _published = 0;
+  uint32_t _acked = 0;
+  uint32_t _untracked = 0;
+  uint32_t _dropped = 0; // refused by the client
+  uint32_t _expired = 0;
+  uint32_t _inbox_dropped = 0;
+  uint32_t _errors = 0;
+  int _outbox_bytes = 0;
+  int _outbox_peak = 0;
+  uint32_t _connects = 0;
+  int64_t _down_since_us = 0; // 0 while connected
+  int64_t _down_total_us = 0;
+};
+
+#endif
+
+#endif /* ifndef _MQTT_STATS_H_ */
@@ -0,0 +1,85 @@
+#ifndef _OUTBOX_H_
+#define _OUTBOX_H_
+
+#include <events.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <nvs.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if CONFIG_MQTT_OUTBOX
+
+// a sensor reading kept while the broker cannot be reached
+struct __attribute__((packed)) OutboxRecord {
+  uint32_t timestamp; // unix time, in seconds
+  float value;
+  WallControllerEvent event;
+};
+
+struct OutboxStats {
+  uint32_t buffered; // records pushed since boot
+  uint32_t replayed; // records taken since boot
+  uint32_t evicted; // oldest records overwritten because the outbox was full
+  uint32_t pending;
+};
+
+// Bounded store-and-forward buffer of readings, oldest first. Records are
+// gathered in RAM and written to NVS a whole chunk at a time, so an outage
+// costs one flash write per CONFIG_MQTT_OUTBOX_CHUNK_RECORDS readings and
+// NVS spreads those writes over its pages. The chunks form a ring of
+// CONFIG_MQTT_OUTBOX_CHUNKS blobs; when it is full the oldest chunk is
+// evicted. Readings still in the RAM chunk are lost on reset. The read
+// position is only saved once a chunk is taken, so after a reset the
+// records of the head chunk taken before it, at most
+// CONFIG_MQTT_OUTBOX_CHUNK_RECORDS, are handed on again. Records name
+// their event by its WallControllerEvent value, so chunks left by a
+// firmware with another event registry are dropped at begin(). Safe to
+// use from several tasks.
+class Outbox {
+  public:
+  // opens the NVS namespace and picks up what an earlier boot left
+  bool begin();
+  void push(const OutboxRecord&);
+  // copies the oldest record without removing it
+  bool peek(OutboxRecord&);
+  // removes the oldest record if it is still the one peek() returned, it
+  // may have been evicted meanwhile
+  void pop(const OutboxRecord&);
+  OutboxStats stats();
+
+  private:
+  static constexpr size_t CHUNK_RECORDS = CONFIG_MQTT_OUTBOX_CHUNK_RECORDS;
+  static constexpr size_t CHUNKS = CONFIG_MQTT_OUTBOX_CHUNKS;
+
+  // the ring position, persisted along with the chunks
+  struct Meta {
+    uint16_t head; // oldest chunk in NVS
+    uint16_t count; // chunks in NVS
+    uint16_t read; // records of the head chunk already taken
+  };
+
+  bool checkLayout();
+  bool loadHead();
+  void popHead();
+  void saveMeta();
+  void chunkKey(size_t chunk, char* key);
+
+  SemaphoreHandle_t _lock = nullptr;
+  nvs_handle_t _nvs = 0;
+  Meta _meta {};
+  // the head chunk as read back from NVS, valid while _head_loaded
+  OutboxRecord _head[CHUNK_RECORDS];
+  bool _head_loaded = false;
+  // records not written to NVS yet, they come after all the chunks
+  OutboxRecord _tail[CHUNK_RECORDS];
+  size_t _tail_count = 0;
+  size_t _tail_read = 0;
+  uint32_t _buffered = 0;
+  uint32_t _replayed = 0;
+  uint32_t _evicted = 0;
+};
+
+#endif
+
+#endif /* ifndef _OUTBOX_H_ */
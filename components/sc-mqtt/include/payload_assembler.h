@@ -0,0 +1,52 @@
+#ifndef _PAYLOAD_ASSEMBLER_H_
+#define _PAYLOAD_ASSEMBLER_H_
+
+#include <stddef.h>
+#include <string.h>
+#include <string_view>
+
+// Gathers a payload the MQTT client hands over in several MQTT_EVENT_DATA,
+// when it does not fit its receive buffer, into a fixed arena of N bytes.
+// The size is known from the first chunk, so a payload too large for the
+// arena is turned down before any of it is copied. Chunks must come in
+// order, which they do: the client delivers one message at a time.
+template <size_t N> class PayloadAssembler {
+  public:
+  // starts a payload of total bytes; false when it does not fit
+  bool begin(size_t total)
+  {
+    _total = total;
+    _received = 0;
+    _active = total <= N;
+    return _active;
+  }
+
+  // adds the chunk found at offset in the payload; returns true once the
+  // whole payload is in. A chunk out of sequence drops the payload.
+  bool append(size_t offset, std::string_view chunk)
+  {
+    if (!_active || offset != _received
+        || chunk.size() > _total - _received) {
+      _active = false;
+      return false;
+    }
+    memcpy(_arena + _received, chunk.data(), chunk.size());
+    _received += chunk.size();
+    if (_received < _total) {
+      return false;
+    }
+    _active = false;
+    return true;
+  }
+
+  // the payload append() completed, valid until the next begin()
+  std::string_view payload() const { return std::string_view(_arena, _total); }
+
+  private:
+  char _arena[N];
+  size_t _total = 0;
+  size_t _received = 0;
+  bool _active = false;
+};
+
+#endif /* ifndef _PAYLOAD_ASSEMBLER_H_ */
@@ -0,0 +1,103 @@
+#ifndef _PUBLISH_SCHEDULER_H_
+#define _PUBLISH_SCHEDULER_H_
+
+#include <events.h>
+#include <stdint.h>
+
+// How an event goes out to the broker
+enum PublishLane : uint8_t {
+  // published right away with esp_mqtt_client_publish, QoS0, bypassing the
+  // client's outbox and the token bucket
+  PUBLISH_INTERACTIVE,
+  // enqueued with QoS1 and never held back: status, heartbeat, OTA progress
+  PUBLISH_STATE,
+  // sensor readings, enqueued with CONFIG_MQTT_TELEMETRY_QOS when the token
+  // bucket allows it and deferred otherwise
+  PUBLISH_TELEMETRY,
+};
+
+constexpr PublishLane publishLane(const EventDescriptor& desc)
+{
+  switch (desc.payload) {
+  case EVENT_PAYLOAD_TOUCH:
+    return PUBLISH_INTERACTIVE;
+  case EVENT_PAYLOAD_FLOAT:
+    return PUBLISH_TELEMETRY;
+  default:
+    return PUBLISH_STATE;
+  }
+}
+
+// Caps a sustained rate of rate_per_s with bursts of up to burst. The
+// tokens are kept as microseconds of credit, so refilling is a subtraction
+// of int64_t now_us timestamps rather than a division.
+class TokenBucket {
+  public:
+  TokenBucket(uint32_t rate_per_s, uint32_t burst)
+      : _cost_us(1000000 / (rate_per_s ? rate_per_s : 1))
+      , _capacity_us((int64_t)_cost_us * (burst ? burst : 1))
+  {
+  }
+
+  bool take(int64_t now_us)
+  {
+    if (_credit_us < _capacity_us) {
+      _credit_us += now_us - _last_us;
+      if (_credit_us > _capacity_us || _last_us == 0) {
+        _credit_us = _capacity_us;
+      }
+    }
+    _last_us = now_us;
+    if (_credit_us < _cost_us) {
+      return false;
+    }
+    _credit_us -= _cost_us;
+    return true;
+  }
+
+  private:
+  int64_t _cost_us;
+  int64_t _capacity_us;
+  int64_t _credit_us = 0;
+  int64_t _last_us = 0;
+};
+
+// Telemetry the token bucket held back, one slot per event so a burst of
+// readings costs no more memory than a single one: a newer reading replaces
+// the deferred one. Slots are handed back lowest event id first.
+class DeferredTelemetry {
+  public:
+  void defer(const Event& event)
+  {
+    if (_pending & eventMask(event.event)) {
+      _replaced++;
+    }
+    _values[event.event] = event.value;
+    _pending |= eventMask(event.event);
+  }
+
+  bool empty() const { return _pending == 0; }
+
+  // the pending slot with the lowest event id, valid while !empty()
+  Event front() const
+  {
+    Event event {};
+    event.event = (WallControllerEvent)__builtin_ctz(_pending);
+    event.value = _values[event.event];
+    return event;
+  }
+
+  void pop() { _pending &= _pending - 1; }
+
+  void clear() { _pending = 0; }
+
+  // deferred readings a newer one replaced before they went out
+  uint32_t replaced() const { return _replaced; }
+
+  private:
+  float _values[EVENT_MAX] = {};
+  EventMask _pending = 0;
+  uint32_t _replaced = 0;
+};
+
+#endif /* ifndef _PUBLISH_SCHEDULER_H_ */
@@ -0,0 +1,83 @@
+#ifndef _TOPIC_TABLE_H_
+#define _TOPIC_TABLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+// FNV-1a over exactly len bytes
+constexpr uint32_t topicHash(const char* s, size_t len)
+{
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (uint8_t)s[i]) * 16777619u;
+  }
+  return h;
+}
+
+// Exact-match lookup of a topic in a fixed list of entries having a TOPIC
+// member, built at compile time. It is an open-addressed hash table kept at
+// most half full and keyed on hash and length: a lookup hashes the topic
+// once, probes about one slot and compares the bytes of a single candidate,
+// whatever the number of entries. The topic looked up need not be NUL
+// terminated, MQTT_EVENT_DATA topics are not.
+template <size_t N> class TopicTable {
+  static_assert(N > 0 && N < 255, "unsupported number of topics");
+
+  public:
+  template <typename Entry> constexpr TopicTable(const Entry (&entries)[N])
+  {
+    for (size_t i = 0; i < N; i++) {
+      const char* topic = entries[i].TOPIC;
+      size_t len = std::char_traits<char>::length(topic);
+      uint32_t hash = topicHash(topic, len);
+      size_t s = hash & (SLOTS - 1);
+      while (_slots[s].index != EMPTY) {
+        s = (s + 1) & (SLOTS - 1);
+      }
+      _slots[s] = Slot { topic, hash, (uint16_t)len, (uint8_t)i };
+    }
+  }
+
+  // index of the entry with exactly this topic, -1 if there is none
+  int find(const char* topic, size_t len) const
+  {
+    uint32_t hash = topicHash(topic, len);
+    for (size_t s = hash & (SLOTS - 1);; s = (s + 1) & (SLOTS - 1)) {
+      const Slot& slot = _slots[s];
+      if (slot.index == EMPTY) {
+        return -1;
+      }
+      if (slot.hash == hash && slot.len == len
+          && memcmp(slot.topic, topic, len) == 0) {
+        return slot.index;
+      }
+    }
+  }
+
+  private:
+  static constexpr size_t slotsFor(size_t n)
+  {
+    size_t slots = 2;
+    while (slots < 2 * n) {
+      slots *= 2;
+    }
+    return slots;
+  }
+  static constexpr size_t SLOTS = slotsFor(N);
+  static constexpr uint8_t EMPTY = 0xff;
+
+  struct Slot {
+    const char* topic = nullptr;
+    uint32_t hash = 0;
+    uint16_t len = 0;
+    uint8_t index = EMPTY;
+  };
+  Slot _slots[SLOTS] {};
+};
+
+template <typename Entry, size_t N>
+TopicTable(const Entry (&)[N]) -> TopicTable<N>;
+
+#endif /* ifndef _TOPIC_TABLE_H_ */
@@ -3,9 +3,15 @@
 #include "backlight.h"
 #include "buzzer.h"
 #include "events.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 #include <cstdio>
+#include <esp_cpu.h>
 #include <esp_err.h>
 #include <esp_event.h>
+#include <esp_heap_caps.h>
+#include <esp_heap_trace.h>
 #include <esp_log.h>
 #include <esp_ota_ops.h>
 #include <esp_partition.h>
@@ -14,19 +20,43 @@
 #include <freertos/semphr.h>
 #include <freertos/task.h>
 #include <mqtt_client.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <string.h>
+#include <string_view>
+#include <time.h>
 #if defined(CONFIG_HAS_INTERNAL_SENSOR) || defined(CONFIG_HAS_EXTERNAL_SENSOR)
 #include "sensors.h"
 #endif
+#include <event_histogram.h>
+#include <event_trace.h>
+#include <event_worker.h>
 #include <events.h>
+#include <rate_policy.h>
+#include "broker_list.h"
+#include "command_parser.h"
+#include "fixed_format.h"
+#include "mqtt_stats.h"
+#include "outbox.h"
+#include "payload_assembler.h"
+#include "publish_scheduler.h"
+#include "topic_table.h"
 
 extern TaskHandle_t otaTaskHandle;
 extern bool wifi_connected;
+extern std::atomic<bool> wifi_link_up;
 void otaTask(void*);
 
 static const char* TAG = "MQTT";
 extern TaskHandle_t mqttTaskHandle;
+// bits notified to mqttTask; wifiTask notifies 0x2 when WiFi is lost or
+// back
+constexpr uint32_t NOTIFY_DISCONNECTED = 0x1;
+constexpr uint32_t NOTIFY_SWITCH_BROKER = 0x4; // to brokers.current()
+constexpr uint32_t NOTIFY_PUBLISH_STATS = 0x8;
+constexpr uint32_t NOTIFY_CONNECTED = 0x10; // replays the outbox, see brokers
+constexpr uint32_t NOTIFY_HISTORY_ACKED = 0x20; // see replayHistory()
+constexpr uint32_t NOTIFY_BROKER_LOST = 0x40; // or a connection attempt failed
 #define MQTT_TOPIC_NIGHT_MODE "cmd/barlog/night_mode"
 #define MQTT_TOPIC_LIGHTS "cmd/" CONFIG_HOSTNAME "/lights"
 #define MQTT_TOPIC_POLL_NIGHT_MODE "state/barlog/night_mode"
@@ -37,208 +67,603 @@ extern TaskHandle_t mqttTaskHandle;
 #define MQTT_TOPIC_DISPLAY "cmd/" CONFIG_HOSTNAME "/display"
 #define MQTT_TOPIC_CONTROL "cmd/" CONFIG_HOSTNAME "/control"
 #define MQTT_TOPIC_AIR_QUALITY "state/" CONFIG_HOSTNAME "/air_quality"
+#define MQTT_TOPIC_EVENT_STATS "cmd/" CONFIG_HOSTNAME "/event_stats"
+#define MQTT_TOPIC_TRACE "cmd/" CONFIG_HOSTNAME "/trace"
+#define MQTT_TOPIC_BROKERS "cmd/" CONFIG_HOSTNAME "/brokers"
+#define MQTT_TOPIC_PING "cmd/" CONFIG_HOSTNAME "/ping"
+#define MQTT_TOPIC_MQTT_STATS "cmd/" CONFIG_HOSTNAME "/mqtt_stats"
+#define MQTT_TOPIC_COMMANDS "cmd/" CONFIG_HOSTNAME "/#"
+#define MQTT_PREFIX "barlog/" CONFIG_HOSTNAME
+
+static esp_mqtt_client_handle_t client;
+
+// barlog/<host>/<leaf topic> of every event, see event_registry.h
+#define EVENT_TOPIC(id, payload, topic, ...) MQTT_PREFIX "/" topic,
+#define SENSOR_TOPIC(id, name, topic, ...) MQTT_PREFIX "/" topic,
+static const char* const MQTT_EVENT_TOPICS[] = { WALL_CONTROLLER_EVENTS(
+    EVENT_TOPIC, SENSOR_TOPIC) };
+#undef EVENT_TOPIC
+#undef SENSOR_TOPIC
+// the longest payload of an event, see formatFixed
+constexpr size_t FORMAT_BUFSIZE = 13;
+
+// without a BME680 the air quality readings come from the broker, see
+// handleAirQuality, and are not echoed back to it
+constexpr EventMask MQTT_EVENT_MASK = EVENT_MASK_ALL
+    & ~eventMask(EVENT_STATUS_UPDATE)
+#if !CONFIG_USE_SENSOR_BME680
+    & ~(eventMask(EVENT_SENSOR_IAQ) | eventMask(EVENT_SENSOR_CO2)
+        | eventMask(EVENT_SENSOR_VOC))
+#endif
+    ;
 
 class MqttEventObserver : public EventObserver {
+  public:
+  MqttEventObserver();
   virtual void notice(const Event&) override;
   virtual const char* name() override { return "mqtt"; }
+  // makes the next reading of every channel pass; safe from any task, the
+  // limiters are reset by the task noticing events, on the next event
+  void requestRateLimitReset() { _reset_requested = true; }
+  // publishes the deferred telemetry the token bucket lets through by now;
+  // called on every event noticed and by mqttTask in between, returns
+  // whether some is left
+  bool flushDeferred();
+
+  private:
+  bool admit(int64_t now_us);
+  void publish(const Event&);
+  RateLimiter<float> _limiters[EVENT_MAX];
+  std::atomic<bool> _reset_requested { false };
+  // guards _bucket and _deferred, used from the observer's task and mqttTask
+  SemaphoreHandle_t _scheduler_lock;
+  TokenBucket _bucket { CONFIG_MQTT_PUBLISH_RATE, CONFIG_MQTT_PUBLISH_BURST };
+  DeferredTelemetry _deferred;
+  uint32_t _deferrals = 0;
+#if CONFIG_MQTT_AGGREGATED_TELEMETRY
+  void collectTelemetry(const Event&);
+  void publishTelemetry();
+  float _window_values[EVENT_MAX] = {};
+  EventMask _window_present = 0;
+  int64_t _window_start_us = 0;
+  uint32_t _telemetry_seq = 0;
+#endif
 };
+static MqttEventObserver observer;
+#if CONFIG_MQTT_OUTBOX
+// readings noticed while the broker cannot be reached
+static Outbox outbox;
+// The reading replayHistory() published last. It is only removed from the
+// outbox once its PUBACK comes, so a reset or a lost connection meanwhile
+// sends it again: history is delivered at least once, and consumers tell
+// duplicates by their metric and timestamp. Only mqttTask touches
+// replayRecord, the client task compares PUBACK ids with replayMsgId.
+static OutboxRecord replayRecord;
+static std::atomic<int> replayMsgId { 0 };
+static int64_t replaySentUs = 0;
+static int64_t nextReplayUs = 0;
+// a PUBACK missed in a reconnect makes the reading go again after this
+constexpr int64_t REPLAY_ACK_TIMEOUT_US
+    = (int64_t)CONFIG_MQTT_KEEPALIVE * 1000 * 1000;
+#endif
+#if CONFIG_MQTT_OBSERVER_WORKER
+static EventWorker<CONFIG_MQTT_OBSERVER_INBOX_LENGTH> observerWorker(
+    observer, INBOX_DROP_OLDEST);
+static EventObserver& eventsObserver = observerWorker;
+#else
+static EventObserver& eventsObserver = observer;
+#endif
+
+#if CONFIG_MQTT_STATS
+static MqttStats mqttStats;
+#endif
+
+// Every message to the broker goes through one of these, so the link stats
+// see them all.
+static int mqttEnqueue(const char* topic, const char* data, int len, int qos,
+    int retain, bool store)
+{
+  int msg_id
+      = esp_mqtt_client_enqueue(client, topic, data, len, qos, retain, store);
+#if CONFIG_MQTT_STATS
+  mqttStats.sent(msg_id, qos, esp_mqtt_client_get_outbox_size(client),
+      esp_timer_get_time());
+#endif
+  return msg_id;
+}
+
+static int mqttPublish(
+    const char* topic, const char* data, int len, int qos, int retain)
+{
+  int msg_id = esp_mqtt_client_publish(client, topic, data, len, qos, retain);
+#if CONFIG_MQTT_STATS
+  mqttStats.sent(msg_id, qos, esp_mqtt_client_get_outbox_size(client),
+      esp_timer_get_time());
+#endif
+  return msg_id;
+}
 
+static int mqttSubscribe(const char* topic, int qos)
+{
+  int msg_id = esp_mqtt_client_subscribe(client, topic, qos);
+#if CONFIG_MQTT_STATS
+  mqttStats.subscribed(msg_id, esp_timer_get_time());
+#endif
+  ESP_LOGI(TAG, "Subscribed to %s with %d", topic, msg_id);
+  return msg_id;
+}
+
+static uint32_t commandsRejected = 0;
+
+// Handlers get a view of the payload in the MQTT client's buffer, which is
+// not NUL terminated. Those taking arguments declare them in a grammar
+// instead, and get them parsed, see command_parser.h; a payload not
+// matching the grammar is logged and dropped before reaching them.
+// Payloads larger than the client's receive buffer arrive in chunks, which
+// are gathered up to CONFIG_MQTT_REASSEMBLY_SIZE bytes before the handler
+// is called; a stream handler gets the chunks as they come instead, with
+// their offset in a payload of total bytes, whatever its size.
 struct MqttSubscription {
   const char* TOPIC;
   int qos;
-  int subscription_id;
-  typedef void handler_func(const char*, int);
+  typedef void handler_func(std::string_view);
   handler_func* func;
-  void subscribe(esp_mqtt_client_handle_t client)
+  typedef void command_func(const CommandArgs&);
+  const CommandGrammar* grammar;
+  command_func* command;
+  typedef void stream_func(std::string_view chunk, size_t offset, size_t total);
+  stream_func* stream;
+  void subscribe() const { mqttSubscribe(TOPIC, qos); }
+  // returns nullptr once handled, or why the payload was turned down
+  const char* operator()(std::string_view data) const
   {
-    subscription_id = esp_mqtt_client_subscribe(client, TOPIC, qos);
-    ESP_LOGI(TAG, "Subscribed to %s with %u", TOPIC, subscription_id);
-  }
-  void operator()(const char* data, int data_len)
-  {
-    if (func == nullptr) {
+    if (command != nullptr) {
+      CommandArgs args;
+      CommandResult result = parseCommand(data, *grammar, args);
+      if (result.status != COMMAND_OK) {
+        commandsRejected++;
+        ESP_LOGE(TAG, "%s: %s at word %u of %.*s", TOPIC,
+            commandStatusText(result.status), result.word + 1,
+            (int)data.size(), data.data());
+        return commandStatusName(result.status);
+      }
+      (*command)(args);
+    } else if (func == nullptr) {
       ESP_LOGE(TAG, "Unhandled topic subscription %s received data %.*s",
-          TOPIC, data_len, data);
+          TOPIC, (int)data.size(), data.data());
+      return "unhandled";
     } else {
-      (*func)(data, data_len);
+      (*func)(data);
     }
+    return nullptr;
   };
 };
 
+static constexpr const char* ON_OFF[] = { "on", "off" };
+enum { ON, OFF };
+static constexpr CommandGrammar ON_OFF_GRAMMAR = commandGrammar(
+    keywordArg(ON_OFF));
+
 void setDisplayBacklight(bool on);
 bool night_mode = false;
-void handleNightMode(const char* data, int data_len)
+void handleNightMode(const CommandArgs& args)
 {
-  // this receives only "on" or "off" string
-  if (strncasecmp(data, "on", data_len) == 0) {
-    night_mode = true;
-    // setDisplayBacklight(false);
-    return;
-  }
-  if (strncasecmp(data, "off", data_len) == 0) {
-    night_mode = false;
-    // setDisplayBacklight(true);
-    return;
-  }
-  ESP_LOGE(
-      TAG, "handleNightMode received unknown parameter %.*s", data_len, data);
+  night_mode = args.keyword(0) == ON;
+  // setDisplayBacklight(!night_mode);
 }
 
 #if CONFIG_HAS_INTERNAL_SENSOR
-void handleCalibrate(const char* data, int data_len)
+// temp RH IAQ
+static constexpr CommandGrammar CALIBRATE_GRAMMAR = commandGrammar(
+    floatArg(), floatArg(), floatArg());
+void handleCalibrate(const CommandArgs& args)
 {
-  // calibrate message payload has three float values: temp RH IAQ
-  if (data == nullptr || data_len < 5) {
-    ESP_LOGE(TAG, "handleCalibrate: Incorrect data received");
-    return;
-  }
-  float cal_temperature, cal_rel_humidity, cal_iaq;
-  if (3
-      != sscanf(
-          data, "%f %f %f", &cal_temperature, &cal_rel_humidity, &cal_iaq)) {
-    ESP_LOGE(TAG, "handleCalibrate: incorrect params %.*s", data_len, data);
-  } else {
-    ESP_LOGI(TAG, "handleCalibrate: accepted %.*s", data_len, data);
-    sensors_info.set_cal_values(cal_temperature, cal_rel_humidity, cal_iaq);
-  }
+  ESP_LOGI(TAG, "handleCalibrate: accepted %.2f %.2f %.2f", args.number(0),
+      args.number(1), args.number(2));
+  sensors_info.set_cal_values(args.number(0), args.number(1), args.number(2));
 }
-void handleAirQuality(const char* data, int data_len)
+
+// CO2 IAQ
+static constexpr CommandGrammar AIR_QUALITY_GRAMMAR = commandGrammar(
+    floatArg(), floatArg());
+void handleAirQuality(const CommandArgs& args)
 {
-  // air quality message payload has two float values: CO2 IAQ
-  if (data == nullptr || data_len < 3) {
-    ESP_LOGE(TAG, "handleAirQuality: Incorrect data received");
-    return;
-  }
-  float co2, iaq;
-  if (2 != sscanf(data, "%f %f", &co2, &iaq)) {
-    ESP_LOGE(TAG, "handleAirQuality: incorrect params %.*s", data_len, data);
-  } else {
-    ESP_LOGI(TAG, "handleAirQuality: accepted %.*s", data_len, data);
-    events.postAirCO2Event(co2);
-    events.postIAQEvent(iaq);
-  }
+  ESP_LOGI(TAG, "handleAirQuality: accepted %.2f %.2f", args.number(0),
+      args.number(1));
+  events.postAirCO2Event(args.number(0));
+  events.postIAQEvent(args.number(1));
 }
 #endif
 
 #if CONFIG_HAS_EXTERNAL_SENSOR
-void handleExtCalibrate(const char* data, int data_len)
+// temp RH
+static constexpr CommandGrammar EXT_CALIBRATE_GRAMMAR = commandGrammar(
+    floatArg(), floatArg());
+void handleExtCalibrate(const CommandArgs& args)
 {
-  if (data == nullptr || data_len < 3) {
-    ESP_LOGE(TAG, "handleExtCalibrate: incorrect data received");
-    return;
-  }
-  float cal_temperature, cal_rel_humidity;
-  if (2 != sscanf(data, "%f %f", &cal_temperature, &cal_rel_humidity)) {
-    ESP_LOGE(
-        TAG, "handleExtCalibrate: incorrect params %.*s", data_len, data);
-  } else {
-    ESP_LOGI(TAG, "handleExtCalibrate: accepted %.*s", data_len, data);
-    sensors_info.set_ext_cal_values(cal_temperature, cal_rel_humidity);
-    buzzer.ackTone();
-  }
+  ESP_LOGI(TAG, "handleExtCalibrate: accepted %.2f %.2f", args.number(0),
+      args.number(1));
+  sensors_info.set_ext_cal_values(args.number(0), args.number(1));
+  buzzer.ackTone();
 }
 #endif
 
-void handleOtaCmd(const char* data, int data_len)
+static constexpr const char* OTA_COMMANDS[] = { "start" };
+static constexpr CommandGrammar OTA_GRAMMAR = commandGrammar(
+    keywordArg(OTA_COMMANDS));
+void handleOtaCmd(const CommandArgs&)
 {
-  constexpr size_t CMD_LENGTH = 8;
-  const char* STR_CMD_START = "start";
-  char cmd[CMD_LENGTH + 1];
-  sscanf(data, "%7s", cmd);
-  if (strncasecmp(cmd, STR_CMD_START, CMD_LENGTH) == 0) {
-    xTaskCreate(&otaTask, "otaTask", 8192, NULL, 3, &otaTaskHandle);
-  }
+  xTaskCreate(&otaTask, "otaTask", 8192, NULL, 3, &otaTaskHandle);
 }
 
-void handleSound(const char* data, int data_len)
+// "alert on|off", "warning on|off" or "doorbell"
+static constexpr const char* SOUNDS[] = { "alert", "warning", "doorbell" };
+enum { SOUND_ALERT, SOUND_WARNING, SOUND_DOORBELL };
+static constexpr CommandGrammar SOUND_GRAMMAR = commandGrammar(
+    keywordArg(SOUNDS), optional(keywordArg(ON_OFF)));
+void handleSound(const CommandArgs& args)
 {
-  ESP_LOGI(TAG, "handleSound %*s", data_len, data);
-  if (strncasecmp(data, "alert on", 8) == 0) {
-    BackLight::turnOn();
-    buzzer.startAlert();
-  } else if (strncasecmp(data, "alert off", 9) == 0) {
-    buzzer.stopAlert();
-  } else if (strncasecmp(data, "doorbell", 8) == 0) {
+  bool on = args.count > 1 && args.keyword(1) == ON;
+  bool off = args.count > 1 && args.keyword(1) == OFF;
+  switch (args.keyword(0)) {
+  case SOUND_ALERT:
+    if (on) {
+      BackLight::turnOn();
+      buzzer.startAlert();
+    } else if (off) {
+      buzzer.stopAlert();
+    }
+    break;
+  case SOUND_WARNING:
+    if (on) {
+      BackLight::turnOn();
+      buzzer.startWarning();
+    } else if (off) {
+      buzzer.stopWarning();
+    }
+    break;
+  case SOUND_DOORBELL:
     buzzer.doorbell();
-  } else if (strncasecmp(data, "warning on", 10) == 0) {
-    BackLight::turnOn();
-    buzzer.startWarning();
-  } else if (strncasecmp(data, "warning off", 11) == 0) {
-    buzzer.stopWarning();
+    break;
   }
 }
 
 // handle the display mqtt event; when payload is "on" or "off" turn the
 // display on or off. However, if the display is turned on, then a timer will
 // be set to turn it off after a while.
-void handleDisplay(const char* data, int data_len)
+void handleDisplay(const CommandArgs& args)
 {
-  if (strncasecmp(data, "on", data_len) == 0) {
+  if (args.keyword(0) == ON) {
     BackLight::turnOn();
-    return;
-  }
-  if (strncasecmp(data, "off", data_len) == 0) {
+  } else {
     BackLight::turnOff();
-    return;
   }
-  ESP_LOGE(TAG, "handleDisplay received unknown parameter %.*s", data_len, data);
 }
 
-void handleControl(const char* data, int data_len)
+static constexpr const char* CONTROL_COMMANDS[] = { "reboot" };
+static constexpr CommandGrammar CONTROL_GRAMMAR = commandGrammar(
+    keywordArg(CONTROL_COMMANDS));
+void handleControl(const CommandArgs&)
+{
+  ESP_LOGI(TAG, "Rebooting");
+  esp_restart();
+}
+
+// stores the comma separated broker URIs to use from the next start of the
+// MQTT task on; an empty payload goes back to CONFIG_MQTT_BROKER_URIS
+void handleBrokers(std::string_view data)
+{
+  if (BrokerList::storeOverride(data.data(), data.size())) {
+    ESP_LOGI(TAG, "Brokers set to %.*s", (int)data.size(), data.data());
+  } else {
+    ESP_LOGE(TAG, "Cannot store brokers %.*s", (int)data.size(),
+        data.data());
+  }
+}
+
+// echoes the payload on barlog/<host>/pong right away, for
+// tools/mqtt_load.py to time command handling
+void handlePing(std::string_view data)
+{
+  mqttPublish(MQTT_PREFIX "/pong", data.data(), data.size(), 0, 0);
+}
+
+#if CONFIG_MQTT_STATS
+// publishes barlog/<host>/mqtt_stats now rather than at the next interval
+void handleMqttStats(std::string_view)
+{
+  xTaskNotify(mqttTaskHandle, NOTIFY_PUBLISH_STATS, eSetBits);
+}
+#endif
+
+#if CONFIG_EVENTS_INSTRUMENTATION
+// CPU cycles spent by the observer publishing an event, see notice()
+static Log2Histogram<> formatCycles;
+static Log2Histogram<> enqueueCycles;
+static Log2Histogram<> fastLaneCycles;
+
+// publish the event bus latency histograms, whatever the payload
+void handleEventStats(std::string_view)
+{
+  static char stats[640];
+  size_t len = events.formatHistograms(stats, sizeof(stats));
+  auto append = [&](const char* name, const Log2Histogram<>& h) {
+    if (len < sizeof(stats)) {
+      len += snprintf(stats + len, sizeof(stats) - len, "cycles %s: ", name);
+    }
+    if (len < sizeof(stats)) {
+      len += h.format(stats + len, sizeof(stats) - len);
+    }
+    if (len < sizeof(stats)) {
+      len += snprintf(stats + len, sizeof(stats) - len, "\n");
+    }
+  };
+  append("format", formatCycles);
+  append("enqueue", enqueueCycles);
+  append("fast lane", fastLaneCycles);
+  len = std::min(len, sizeof(stats) - 1);
+  mqttEnqueue(MQTT_PREFIX "/event_stats", stats, len, 0, 0, false);
+}
+#endif
+
+#if CONFIG_EVENTS_TRACE
+// precedes the little-endian TraceRecords of each barlog/<host>/trace chunk
+struct __attribute__((packed)) TraceChunkHeader {
+  char magic[4]; // "SCTR"
+  uint16_t chunk;
+  uint16_t chunks;
+};
+
+// publish the trace ring, whatever the payload: the observer id to name map
+// on barlog/<host>/trace/observers, then the records, oldest first, in
+// chunks on barlog/<host>/trace
+void handleTrace(std::string_view)
 {
-  if (strncasecmp(data, "reboot", data_len) == 0) {
-    ESP_LOGI(TAG, "Rebooting");
-    esp_restart();
+  char names[128];
+  size_t used = 0;
+  for (uint8_t id = 0; id < CONFIG_EVENTS_MAX_OBSERVERS; id++) {
+    const char* name = events.observerName(id);
+    if (name != nullptr && used < sizeof(names)) {
+      used += snprintf(
+          names + used, sizeof(names) - used, "%d %s\n", id, name);
+    }
+  }
+  mqttEnqueue(MQTT_PREFIX "/trace/observers", names,
+      std::min(used, sizeof(names) - 1), 1, 0, true);
+
+  constexpr size_t RECORDS_PER_CHUNK = 128;
+  static uint8_t chunk[sizeof(TraceChunkHeader)
+      + RECORDS_PER_CHUNK * sizeof(TraceRecord)];
+  auto header = reinterpret_cast<TraceChunkHeader*>(chunk);
+  auto records = reinterpret_cast<TraceRecord*>(chunk + sizeof(*header));
+  tracePause(true);
+  size_t count = traceCount();
+  memcpy(header->magic, "SCTR", sizeof(header->magic));
+  header->chunks = (count + RECORDS_PER_CHUNK - 1) / RECORDS_PER_CHUNK;
+  for (header->chunk = 0; header->chunk < header->chunks; header->chunk++) {
+    size_t n = traceCopy(
+        header->chunk * RECORDS_PER_CHUNK, records, RECORDS_PER_CHUNK);
+    mqttEnqueue(MQTT_PREFIX "/trace", (const char*)chunk,
+        sizeof(*header) + n * sizeof(TraceRecord), 1, 0, true);
   }
+  tracePause(false);
+  ESP_LOGI(TAG, "Published %u trace records", count);
 }
+#endif
 
 #pragma GCC diagnostic ignored "-Wmissing-field-initializers"
-struct MqttSubscription mqttSubscriptions[] = {
-  { .TOPIC = MQTT_TOPIC_OTA, .qos = 1, .func = handleOtaCmd },
-  { .TOPIC = MQTT_TOPIC_NIGHT_MODE, .qos = 0, .func = handleNightMode },
+static constexpr MqttSubscription mqttSubscriptions[] = {
+  { .TOPIC = MQTT_TOPIC_OTA,
+      .qos = 1,
+      .grammar = &OTA_GRAMMAR,
+      .command = handleOtaCmd },
+  { .TOPIC = MQTT_TOPIC_NIGHT_MODE,
+      .qos = 0,
+      .grammar = &ON_OFF_GRAMMAR,
+      .command = handleNightMode },
   { .TOPIC = MQTT_TOPIC_LIGHTS, .qos = 1 },
-  { .TOPIC = MQTT_TOPIC_SOUND, .qos = 1, .func = handleSound },
+  { .TOPIC = MQTT_TOPIC_SOUND,
+      .qos = 1,
+      .grammar = &SOUND_GRAMMAR,
+      .command = handleSound },
 #ifdef CONFIG_HAS_INTERNAL_SENSOR
-  { .TOPIC = MQTT_TOPIC_CALIBRATE, .qos = 0, .func = handleCalibrate },
+  { .TOPIC = MQTT_TOPIC_CALIBRATE,
+      .qos = 0,
+      .grammar = &CALIBRATE_GRAMMAR,
+      .command = handleCalibrate },
 #ifdef CONFIG_USE_SENSOR_BME280
-  { .TOPIC = MQTT_TOPIC_AIR_QUALITY, .qos = 1, .func = handleAirQuality },
+  { .TOPIC = MQTT_TOPIC_AIR_QUALITY,
+      .qos = 1,
+      .grammar = &AIR_QUALITY_GRAMMAR,
+      .command = handleAirQuality },
 #endif
 #endif
 #if CONFIG_HAS_EXTERNAL_SENSOR
-  { .TOPIC = MQTT_TOPIC_EXT_CALIBRATE, .qos = 1, .func = handleExtCalibrate },
+  { .TOPIC = MQTT_TOPIC_EXT_CALIBRATE,
+      .qos = 1,
+      .grammar = &EXT_CALIBRATE_GRAMMAR,
+      .command = handleExtCalibrate },
+#endif
+  { .TOPIC = MQTT_TOPIC_DISPLAY,
+      .qos = 1,
+      .grammar = &ON_OFF_GRAMMAR,
+      .command = handleDisplay },
+  { .TOPIC = MQTT_TOPIC_CONTROL,
+      .qos = 1,
+      .grammar = &CONTROL_GRAMMAR,
+      .command = handleControl },
+  { .TOPIC = MQTT_TOPIC_BROKERS, .qos = 1, .func = handleBrokers },
+  { .TOPIC = MQTT_TOPIC_PING, .qos = 0, .func = handlePing },
+#if CONFIG_MQTT_STATS
+  { .TOPIC = MQTT_TOPIC_MQTT_STATS, .qos = 0, .func = handleMqttStats },
+#endif
+#if CONFIG_EVENTS_INSTRUMENTATION
+  { .TOPIC = MQTT_TOPIC_EVENT_STATS, .qos = 0, .func = handleEventStats },
+#endif
+#if CONFIG_EVENTS_TRACE
+  { .TOPIC = MQTT_TOPIC_TRACE, .qos = 0, .func = handleTrace },
 #endif
-  { .TOPIC = MQTT_TOPIC_DISPLAY, .qos = 1, .func = handleDisplay },
-  { .TOPIC = MQTT_TOPIC_CONTROL, .qos = 1, .func = handleControl},
-  { .TOPIC = nullptr }
 };
+static constexpr TopicTable mqttTopics(mqttSubscriptions);
 
-static const char* CONFIG_BROKER_URL = "mqtt://bb-master";
-#define MQTT_PREFIX "barlog/" CONFIG_HOSTNAME
-static esp_mqtt_client_handle_t client;
+// only used by mqttTask, which the client's task notifies of connections
+// made and lost
+static BrokerList brokers;
+// when the connection to the broker was lost, 0 while connected
+static int64_t brokerLostUs = 0;
 bool mqtt_connected = false;
 
 #ifndef CONFIG_HAS_INTERNAL_SENSOR
-static esp_timer_handle_t heartbeat_timer;
+static esp_timer_handle_t heartbeat_timer = nullptr;
 static void postHeartbeatEvent(void*) { events.postHeartbeatEvent(); }
 #endif
 
-static bool needSubscribe = true;
-static void onMqttConnectedEvent(esp_mqtt_client_handle_t client)
+#if CONFIG_MQTT_COMMAND_STATS
+// The standalone heap tracer records every allocation made while an
+// MQTT_EVENT_DATA is handled, from the topic lookup to the handler and its
+// ack; only their number is kept. It sees all tasks, so an allocation made
+// elsewhere meanwhile is counted too.
+constexpr size_t COMMAND_TRACE_RECORDS = 16;
+static heap_trace_record_t commandTraceRecords[COMMAND_TRACE_RECORDS];
+static uint32_t commandsHandled = 0;
+static uint32_t commandAllocations = 0;
+#endif
+
+#if CONFIG_MQTT_PERSISTENT_SESSION
+// one subscription covers every cmd/<host>/ topic, the handlers are then
+// found in mqttTopics; only the topics outside of it are subscribed to
+// one by one
+static void subscribe()
+{
+  constexpr std::string_view COMMANDS = MQTT_TOPIC_COMMANDS;
+  constexpr std::string_view PREFIX = COMMANDS.substr(0, COMMANDS.size() - 1);
+  mqttSubscribe(MQTT_TOPIC_COMMANDS, 1);
+  for (const auto& subscription : mqttSubscriptions) {
+    if (std::string_view(subscription.TOPIC).substr(0, PREFIX.size())
+        != PREFIX) {
+      subscription.subscribe();
+    }
+  }
+}
+#else
+static void subscribe()
+{
+  for (const auto& subscription : mqttSubscriptions) {
+    subscription.subscribe();
+  }
+}
+#endif
+
+// Set by wifiTask when it gets an address, to time how long the first
+// command takes to come through afterwards.
+extern int64_t ip_acquired_us;
+static bool firstCommandSeen = false;
+
+#if CONFIG_MQTT_STATE_SNAPSHOT
+// The last known value of every reading and of the gas status, whether it
+// was published or not; the observer writes it, the client task reads it
+// when connecting.
+static SemaphoreHandle_t stateLock = nullptr;
+static float stateValues[EVENT_MAX];
+static EventMask stateKnown = 0;
+// to log how long the broker took to have the whole state
+static int snapshotMsgId = -1;
+static int64_t connectedUs = 0;
+
+static void rememberState(const Event& event)
+{
+  const EventDescriptor& desc = EVENT_DESCRIPTORS[event.event];
+  if (stateLock == nullptr
+      || (desc.payload != EVENT_PAYLOAD_FLOAT
+          && desc.payload != EVENT_PAYLOAD_BOOL)) {
+    return;
+  }
+  xSemaphoreTake(stateLock, portMAX_DELAY);
+  stateValues[event.event]
+      = desc.payload == EVENT_PAYLOAD_BOOL ? event.gas_status : event.value;
+  stateKnown |= eventMask(event.event);
+  xSemaphoreGive(stateLock);
+}
+
+// Publishes the whole state, retained, on barlog/<host>/state as
+// {"ts":<unix time>,"<metric>":<value>,...}, so consumers are up to date as
+// soon as we are back rather than as readings change; with
+// CONFIG_MQTT_STATE_RESYNC, also every metric on its own topic.
+static void publishStateSnapshot()
 {
-  if (needSubscribe) {
-    MqttSubscription* subscription = &mqttSubscriptions[0];
-    while (subscription->TOPIC) {
-      subscription->subscribe(client);
-      subscription++;
+  float values[EVENT_MAX];
+  EventMask known;
+  xSemaphoreTake(stateLock, portMAX_DELAY);
+  memcpy(values, stateValues, sizeof(values));
+  known = stateKnown;
+  xSemaphoreGive(stateLock);
+  if (known == 0) {
+    return;
+  }
+
+  char doc[512];
+  size_t len = 0;
+  memcpy(doc, "{\"ts\":", 6);
+  len = 6 + formatUnsigned(doc + 6, (uint32_t)time(nullptr));
+  for (EventMask m = known; m; m &= m - 1) {
+    int e = __builtin_ctz(m);
+    const EventDescriptor& desc = EVENT_DESCRIPTORS[e];
+    size_t leaf = strlen(desc.topic);
+    if (!std::isfinite(values[e])
+        || len + leaf + 4 + FORMAT_BUFSIZE + 1 > sizeof(doc)) {
+      continue;
     }
-    needSubscribe = false;
+    doc[len++] = ',';
+    doc[len++] = '"';
+    memcpy(doc + len, desc.topic, leaf);
+    len += leaf;
+    doc[len++] = '"';
+    doc[len++] = ':';
+    len += formatFixed(doc + len, values[e], desc.decimals);
+  }
+  doc[len++] = '}';
+  snapshotMsgId = mqttEnqueue(MQTT_PREFIX "/state", doc, len, 1, 1, true);
+  ESP_LOGI(TAG, "state snapshot: %d values", __builtin_popcount(known));
+
+#if CONFIG_MQTT_STATE_RESYNC
+  for (EventMask m = known; m; m &= m - 1) {
+    int e = __builtin_ctz(m);
+    const EventDescriptor& desc = EVENT_DESCRIPTORS[e];
+    char data[FORMAT_BUFSIZE];
+    size_t n = formatFixed(data, values[e], desc.decimals);
+    mqttEnqueue(MQTT_EVENT_TOPICS[e], data, n,
+        desc.payload == EVENT_PAYLOAD_FLOAT ? CONFIG_MQTT_TELEMETRY_QOS : 1,
+        desc.retain, true);
   }
+#endif
+}
+#endif
+
+static bool needSubscribe = true;
+static void onMqttConnectedEvent(bool session_present)
+{
+#if CONFIG_MQTT_STATE_SNAPSHOT
+  connectedUs = esp_timer_get_time();
+  publishStateSnapshot();
+#endif
+#if !CONFIG_MQTT_STATE_RESYNC
+  observer.requestRateLimitReset(); // republish current values right away
+#endif
+  // with a persistent session the broker remembers our subscriptions
+  if (needSubscribe && !session_present) {
+    subscribe();
+  }
+  needSubscribe = false;
+  firstCommandSeen = false;
+  xTaskNotify(mqttTaskHandle, NOTIFY_CONNECTED, eSetBits);
 #ifndef CONFIG_HAS_INTERNAL_SENSOR
-  esp_timer_create_args_t timer_args = { .callback = postHeartbeatEvent,
-    .arg = nullptr,
-    .dispatch_method = ESP_TIMER_TASK,
-    .skip_unhandled_events = 1 };
-  ESP_ERROR_CHECK(esp_timer_create(&timer_args, &heartbeat_timer));
+  if (heartbeat_timer == nullptr) {
+    esp_timer_create_args_t timer_args = { .callback = postHeartbeatEvent,
+      .arg = nullptr,
+      .dispatch_method = ESP_TIMER_TASK,
+      .skip_unhandled_events = 1 };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &heartbeat_timer));
+  }
   ESP_ERROR_CHECK(
       esp_timer_start_periodic(heartbeat_timer, 60 * 1000 * 1000));
 #endif
@@ -248,12 +673,155 @@ static void onMqttDisconnectedEvent()
 {
   mqtt_connected = false;
   needSubscribe = true;
-  xTaskNotify(mqttTaskHandle, 0x1, eSetBits);
+  xTaskNotify(mqttTaskHandle, NOTIFY_DISCONNECTED, eSetBits);
 #ifndef CONFIG_HAS_INTERNAL_SENSOR
   esp_timer_stop(heartbeat_timer);
 #endif
 }
 
+#if CONFIG_MQTT_COMMAND_ACKS
+// A payload of one of our own commands, a cmd/<host>/ topic parsed with a
+// CommandGrammar, may start with "#<id> ", the id being up to ACK_ID_MAX
+// letters, digits or any of "-_.:"; the rest of the payload is the command.
+// Once it is handled, an ack goes to barlog/<host>/ack as
+// {"id":"<id>","cmd":"<topic leaf>","ok":true|false,"error":"...",
+// "us":<handling time>}, the error being one of the commandStatusName()
+// tokens (missing_argument, too_many_arguments, bad_number,
+// unknown_keyword). Other payloads are left alone: state topics and the
+// shared cmd/barlog/night_mode carry other devices' traffic, and ping and
+// brokers payloads are taken as they are. MQTT 5 correlation data would do
+// the same, but esp-mqtt speaks MQTT 3.1.1 here.
+constexpr size_t ACK_ID_MAX = 32;
+constexpr char OWN_COMMAND_PREFIX[] = "cmd/" CONFIG_HOSTNAME "/";
+
+static bool takesCorrelationId(const MqttSubscription& subscription)
+{
+  return subscription.command != nullptr
+      && strncmp(subscription.TOPIC, OWN_COMMAND_PREFIX,
+             sizeof(OWN_COMMAND_PREFIX) - 1)
+      == 0;
+}
+
+static std::string_view takeCorrelationId(std::string_view& data)
+{
+  if (data.empty() || data[0] != '#') {
+    return {};
+  }
+  size_t end = 1;
+  while (end < data.size() && end <= ACK_ID_MAX
+      && (isalnum((unsigned char)data[end]) || data[end] == '-'
+          || data[end] == '_' || data[end] == '.' || data[end] == ':')) {
+    end++;
+  }
+  if (end == 1 || (end < data.size() && data[end] != ' ')) {
+    return {}; // not an id, leave the payload to the handler
+  }
+  std::string_view id = data.substr(1, end - 1);
+  data = data.substr(std::min(end + 1, data.size()));
+  return id;
+}
+
+static void publishAck(const MqttSubscription& subscription,
+    std::string_view id, const char* error, uint32_t us)
+{
+  const char* leaf = strrchr(subscription.TOPIC, '/') + 1;
+  char ack[160];
+  int len = snprintf(ack, sizeof(ack),
+      "{\"id\":\"%.*s\",\"cmd\":\"%s\",\"ok\":%s,%s%s%s\"us\":%u}",
+      (int)id.size(), id.data(), leaf, error ? "false" : "true",
+      error ? "\"error\":\"" : "", error ? error : "", error ? "\"," : "",
+      us);
+  mqttPublish(MQTT_PREFIX "/ack", ack,
+      std::min(len, (int)sizeof(ack) - 1), 1, 0);
+}
+#endif
+
+static void handleMessage(
+    const MqttSubscription& subscription, std::string_view data)
+{
+#if CONFIG_MQTT_COMMAND_ACKS
+  std::string_view id;
+  if (takesCorrelationId(subscription)) {
+    id = takeCorrelationId(data);
+  }
+  int64_t start = esp_timer_get_time();
+#endif
+  const char* error = subscription(data);
+#if CONFIG_MQTT_COMMAND_ACKS
+  if (!id.empty()) {
+    publishAck(subscription, id, error,
+        (uint32_t)(esp_timer_get_time() - start));
+  }
+#else
+  (void)error;
+#endif
+  if (!firstCommandSeen) {
+    firstCommandSeen = true;
+    ESP_LOGI(TAG, "First command handled %lld ms after getting an IP",
+        (esp_timer_get_time() - ip_acquired_us) / 1000);
+  }
+}
+
+// the payload being received in chunks, for the subscription in
+// dataSubscription; only the first chunk of a message carries its topic
+static PayloadAssembler<CONFIG_MQTT_REASSEMBLY_SIZE> assembler;
+static int dataSubscription = -1;
+
+static void onMqttData(esp_mqtt_event_handle_t event)
+{
+  size_t offset = event->current_data_offset;
+  size_t total = event->total_data_len;
+  std::string_view chunk(event->data, event->data_len);
+  if (offset == 0) {
+    dataSubscription = mqttTopics.find(event->topic, event->topic_len);
+    if (dataSubscription < 0) {
+      ESP_LOGW(TAG, "No subscription for topic %.*s", event->topic_len,
+          event->topic);
+      return;
+    }
+  } else if (dataSubscription < 0) {
+    return; // the rest of a message already turned down
+  }
+  const MqttSubscription& subscription = mqttSubscriptions[dataSubscription];
+  if (subscription.stream != nullptr) {
+    subscription.stream(chunk, offset, total);
+    return;
+  }
+  if (offset == 0 && chunk.size() >= total) {
+    handleMessage(subscription, chunk); // the usual case, nothing to copy
+    return;
+  }
+  if (offset == 0 && !assembler.begin(total)) {
+    ESP_LOGE(TAG, "%s: payload of %u bytes is too large", subscription.TOPIC,
+        total);
+    commandsRejected++;
+    dataSubscription = -1;
+    return;
+  }
+  if (assembler.append(offset, chunk)) {
+    handleMessage(subscription, assembler.payload());
+  }
+}
+
+#if CONFIG_MQTT_COMMAND_STATS
+static void onMqttDataTraced(esp_mqtt_event_handle_t event)
+{
+  bool traced = heap_trace_start(HEAP_TRACE_ALL) == ESP_OK;
+  onMqttData(event);
+  if (!traced) {
+    return;
+  }
+  heap_trace_stop();
+  size_t allocations = heap_trace_get_count();
+  commandsHandled++;
+  commandAllocations += allocations;
+  ESP_LOGI(TAG, "commands: %u, allocations: %u%s (%u in all), rejected: %u",
+      commandsHandled, allocations,
+      allocations >= COMMAND_TRACE_RECORDS ? "+" : "", commandAllocations,
+      commandsRejected);
+}
+#endif
+
 static void mqtt_event_handler(void* handler_args, esp_event_base_t base,
     int32_t event_id, void* event_data)
 {
@@ -261,53 +829,72 @@ static void mqtt_event_handler(void* handler_args, esp_event_base_t base,
       event_id);
   esp_mqtt_event_handle_t event
       = reinterpret_cast<esp_mqtt_event_handle_t>(event_data);
-  esp_mqtt_client_handle_t client = event->client;
-  int msg_id;
   switch ((esp_mqtt_event_id_t)event_id) {
   case MQTT_EVENT_CONNECTED:
-    ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
+    ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED, session present: %d",
+        event->session_present);
     mqtt_connected = true;
-    onMqttConnectedEvent(client);
+#if CONFIG_MQTT_STATS
+    mqttStats.connected(esp_timer_get_time());
+#endif
+    onMqttConnectedEvent(event->session_present);
     break;
   case MQTT_EVENT_DISCONNECTED:
     ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
+    // failed connection attempts end here too
+    xTaskNotify(mqttTaskHandle, NOTIFY_BROKER_LOST, eSetBits);
+#if CONFIG_MQTT_STATS
+    mqttStats.disconnected(esp_timer_get_time());
+#endif
     onMqttDisconnectedEvent();
     break;
 
   case MQTT_EVENT_SUBSCRIBED:
     ESP_LOGD(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
-    msg_id = esp_mqtt_client_publish(client, "/topic/qos0", "data", 0, 0, 0);
-    ESP_LOGD(TAG, "sent publish successful, msg_id=%d", msg_id);
+#if CONFIG_MQTT_STATS
+    mqttStats.acked(event->msg_id, esp_timer_get_time());
+#endif
     break;
   case MQTT_EVENT_UNSUBSCRIBED:
     ESP_LOGD(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
     break;
   case MQTT_EVENT_PUBLISHED:
     ESP_LOGD(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+#if CONFIG_MQTT_STATE_SNAPSHOT
+    if (event->msg_id == snapshotMsgId) {
+      ESP_LOGI(TAG, "Broker has the full state %lld ms after connecting",
+          (esp_timer_get_time() - connectedUs) / 1000);
+      snapshotMsgId = -1;
+    }
+#endif
+#if CONFIG_MQTT_OUTBOX
+    if (event->msg_id == replayMsgId) {
+      xTaskNotify(mqttTaskHandle, NOTIFY_HISTORY_ACKED, eSetBits);
+    }
+#endif
+#if CONFIG_MQTT_STATS
+    mqttStats.acked(event->msg_id, esp_timer_get_time());
+#endif
+    break;
+  case MQTT_EVENT_DELETED:
+    ESP_LOGW(TAG, "MQTT_EVENT_DELETED, msg_id=%d", event->msg_id);
+#if CONFIG_MQTT_STATS
+    mqttStats.expired();
+#endif
     break;
   case MQTT_EVENT_DATA:
     ESP_LOGD(TAG, "MQTT_EVENT_DATA");
-    {
-      MqttSubscription* subscription = &mqttSubscriptions[0];
-      while (subscription->TOPIC) {
-        if (strncmp(subscription->TOPIC, event->topic, event->topic_len)
-            == 0) {
-          char* buffer = (char*)malloc(event->data_len + 1);
-          if (buffer) {
-            memcpy(buffer, event->data, event->data_len);
-            buffer[event->data_len] = 0;
-            (*subscription)(buffer, event->data_len);
-            free(buffer);
-          } else {
-            ESP_LOGE(TAG, "Cannot allocate data buffer");
-          }
-        }
-        subscription++;
-      }
-    }
+#if CONFIG_MQTT_COMMAND_STATS
+    onMqttDataTraced(event);
+#else
+    onMqttData(event);
+#endif
     break;
   case MQTT_EVENT_ERROR:
-    ESP_LOGD(TAG, "MQTT_EVENT_ERROR");
+    ESP_LOGW(TAG, "MQTT_EVENT_ERROR");
+#if CONFIG_MQTT_STATS
+    mqttStats.error();
+#endif
     break;
   default:
     ESP_LOGD(TAG, "Other event id:%d", event->event_id);
@@ -315,130 +902,374 @@ static void mqtt_event_handler(void* handler_args, esp_event_base_t base,
   }
 }
 
+// The broker only needs a new sensor value every so often, unless it
+// changed a lot; the display still gets every reading through its own
+// observer.
+static RatePolicy<float> mqttRatePolicy(WallControllerEvent e)
+{
+  const EventDescriptor& desc = EVENT_DESCRIPTORS[e];
+  if (desc.payload != EVENT_PAYLOAD_FLOAT) {
+    return {};
+  }
+  return { .deadband = desc.deadband,
+    .urgent = desc.urgent,
+    .min_interval_ms = CONFIG_MQTT_PUBLISH_MIN_INTERVAL * 1000,
+    .max_interval_ms = CONFIG_MQTT_PUBLISH_MAX_INTERVAL * 1000 };
+}
+
+MqttEventObserver::MqttEventObserver()
+{
+  _scheduler_lock = xSemaphoreCreateMutex();
+  for (int e = 0; e < EVENT_MAX; e++) {
+    _limiters[e] = RateLimiter<float>(mqttRatePolicy((WallControllerEvent)e));
+  }
+}
+
+// returns the MQTT payload of the event, either a constant string or buf
+// buf must hold FORMAT_BUFSIZE chars
+static std::string_view formatPayload(const Event& event, char* buf)
+{
+  static const char* const GESTURES[TOUCH_GESTURE_MAX] = {
+    "invalid",
+    "short",
+    "long",
+    "swipe-left",
+    "swipe-right",
+    "swipe-up",
+    "swipe-down",
+  };
+  const EventDescriptor& desc = EVENT_DESCRIPTORS[event.event];
+  switch (desc.payload) {
+  case EVENT_PAYLOAD_FLOAT:
+    return std::string_view(
+        buf, formatFixed(buf, event.value, desc.decimals));
+  case EVENT_PAYLOAD_BOOL:
+    return event.gas_status ? "1" : "0";
+  case EVENT_PAYLOAD_TOUCH:
+    return GESTURES[event.gesture < TOUCH_GESTURE_MAX ? event.gesture : 0];
+  default:
+    return desc.constant ? desc.constant : "";
+  }
+}
+
+#if CONFIG_MQTT_AGGREGATED_TELEMETRY
+// precedes the values of a barlog/<host>/telemetry document, followed by one
+// little-endian float per bit set in present, lowest event id first (see
+// event_registry.h for the ids)
+struct __attribute__((packed)) TelemetryHeader {
+  uint8_t version;
+  uint8_t count; // number of values following
+  uint16_t window_s; // CONFIG_MQTT_TELEMETRY_WINDOW
+  uint32_t seq; // restarts from 0 at boot
+  uint32_t timestamp; // unix time, in seconds, of the publish
+  uint32_t present; // EventMask of the values following
+};
+constexpr uint8_t TELEMETRY_VERSION = 1;
+
+// keeps the latest value of every reading; the document is published once
+// the window is over, on the next event noticed after that
+void MqttEventObserver::collectTelemetry(const Event& event)
+{
+  int64_t now = esp_timer_get_time();
+  if (event.event < EVENT_MAX
+      && EVENT_DESCRIPTORS[event.event].payload == EVENT_PAYLOAD_FLOAT) {
+    if (_window_present == 0) {
+      _window_start_us = now;
+    }
+    _window_values[event.event] = event.value;
+    _window_present |= eventMask(event.event);
+  }
+  if (_window_present && mqtt_connected
+      && now - _window_start_us
+          >= (int64_t)CONFIG_MQTT_TELEMETRY_WINDOW * 1000 * 1000) {
+    publishTelemetry();
+  }
+}
+
+void MqttEventObserver::publishTelemetry()
+{
+  uint8_t doc[sizeof(TelemetryHeader) + EVENT_MAX * sizeof(float)];
+  TelemetryHeader header = { .version = TELEMETRY_VERSION,
+    .count = 0,
+    .window_s = CONFIG_MQTT_TELEMETRY_WINDOW,
+    .seq = _telemetry_seq++,
+    .timestamp = (uint32_t)time(nullptr),
+    .present = _window_present };
+  size_t used = sizeof(header);
+  for (EventMask m = _window_present; m; m &= m - 1) {
+    memcpy(doc + used, &_window_values[__builtin_ctz(m)], sizeof(float));
+    used += sizeof(float);
+    header.count++;
+  }
+  memcpy(doc, &header, sizeof(header));
+  ESP_LOGI(TAG, "telemetry %u: %u values", header.seq, header.count);
+  mqttEnqueue(
+      MQTT_PREFIX "/telemetry", (const char*)doc, used, 1, 0, true);
+  _window_present = 0;
+}
+#endif
+
 void MqttEventObserver::notice(const Event& event)
 {
-  const char* eventName = NULL;
-  constexpr size_t DATA_BUSIZE = 8;
-  char data[DATA_BUSIZE];
-  const char* constData = NULL;
-  int retain = 0;
-  memset(data, 0, DATA_BUSIZE);
-  switch (event.event) {
-  case EVENT_HEARTBEAT:
-    eventName = "heartbeat";
-    strcpy(data, "on");
-    retain = 1;
-    break;
-  case EVENT_SENSOR_TEMPERATURE:
-    eventName = "air_temperature";
-    snprintf(data, DATA_BUSIZE, "%4.1f", event.air_temperature);
-    retain = 1;
-    break;
-  case EVENT_SENSOR_HUMIDITY:
-    eventName = "air_humidity";
-    snprintf(data, DATA_BUSIZE, "%4.1f", event.air_humidity);
-    retain = 1;
-    break;
-  case EVENT_SCREEN_TOUCHED: {
-    eventName = "touched";
-    const char* gestures[TOUCH_GESTURE_MAX] = {
-      "invalid",
-      "short",
-      "long",
-      "swipe-left",
-      "swipe-right",
-      "swipe-up",
-      "swipe-down",
-    };
-    constData = gestures[event.touch_info.gesture];
-  } break;
-  case EVENT_SENSOR_GAS_STATUS: // BSEC_OUTPUT_RUN_IN_STATUS
-    eventName = "gas_status";
-    snprintf(data, DATA_BUSIZE, "%d", event.gas_status);
-    retain = 1;
-    break;
-#if CONFIG_USE_SENSOR_BME680
-  case EVENT_SENSOR_IAQ:
-    eventName = "air_iaq";
-    snprintf(data, DATA_BUSIZE, "%.2f", event.air_iaq);
-    retain = 1;
-    break;
-  case EVENT_SENSOR_CO2:
-    eventName = "air_co2";
-    snprintf(data, DATA_BUSIZE, "%.2f", event.air_co2);
-    retain = 1;
-    break;
-  case EVENT_SENSOR_VOC:
-    eventName = "air_voc";
-    snprintf(data, DATA_BUSIZE, "%.2f", event.air_voc);
-    retain = 1;
-    break;
+  const EventDescriptor& desc = EVENT_DESCRIPTORS[event.event];
+#if CONFIG_MQTT_OBSERVER_WORKER
+  if (event.event == EVENT_HEARTBEAT) {
+    auto st = observerWorker.stats();
+    ESP_LOGI(TAG, "worker noticed: %u, dropped: %u, high water: %u",
+        st.noticed, st.dropped, st.high_water);
+  }
 #endif
-  case EVENT_SENSOR_PRESSURE:
-    eventName = "air_pressure";
-    snprintf(data, DATA_BUSIZE, "%.0f", event.air_pressure);
-    retain = 1;
-    break;
-#if CONFIG_HAS_EXTERNAL_SENSOR
-  case EVENT_SENSOR_EXT_TEMPERATURE:
-    eventName = "ext_temperature";
-    snprintf(data, DATA_BUSIZE, "%4.1f", event.air_temperature);
-    retain = 1;
-    break;
-  case EVENT_SENSOR_EXT_HUMIDITY:
-    eventName = "ext_humidity";
-    snprintf(data, DATA_BUSIZE, "%4.1f", event.air_humidity);
-    retain = 1;
-    break;
+#if CONFIG_MQTT_STATE_SNAPSHOT
+  rememberState(event);
 #endif
-  case EVENT_OTA_STARTED:
-    eventName = "ota";
-    strcpy(data, "start");
-    break;
-  case EVENT_OTA_DONE_OK:
-    eventName = "ota";
-    strcpy(data, "OK");
-    break;
-  case EVENT_OTA_DONE_FAIL:
-    eventName = "ota";
-    strcpy(data, "FAIL");
-    break;
-  default:
-    ESP_LOGE(TAG, "Unknown event type %d", event.event);
+#if CONFIG_MQTT_AGGREGATED_TELEMETRY
+  collectTelemetry(event);
+#endif
+#if CONFIG_MQTT_OUTBOX
+  if (event.event == EVENT_HEARTBEAT) {
+    auto st = outbox.stats();
+    ESP_LOGI(TAG,
+        "outbox buffered: %u, replayed: %u, evicted: %u, pending: %u",
+        st.buffered, st.replayed, st.evicted, st.pending);
+  }
+#endif
+  if (event.event == EVENT_HEARTBEAT) {
+    ESP_LOGI(TAG, "telemetry deferred: %u, replaced while deferred: %u",
+        _deferrals, _deferred.replaced());
+  }
+  // before the rate limits, which hold most readings back
+  if (mqtt_connected) {
+    flushDeferred();
+  }
+  if (_reset_requested.exchange(false)) {
+    for (auto& limiter : _limiters) {
+      limiter.reset();
+    }
+  }
+  if (desc.payload == EVENT_PAYLOAD_FLOAT
+      && !_limiters[event.event].shouldPass(
+          event.value, esp_timer_get_time())) {
     return;
   }
 
   if (!mqtt_connected) {
-    ESP_LOGE(TAG, "ignoring event %s", eventName);
-  } else {
-    // finally, post the event
-    const char* eventData = constData ? constData : data;
-    static char* topic = NULL;
-    constexpr size_t TOPIC_LEN = 80;
-    if (topic == NULL) {
-      topic = (char*)malloc(TOPIC_LEN);
+#if CONFIG_MQTT_OUTBOX
+    if (desc.payload == EVENT_PAYLOAD_FLOAT) {
+      outbox.push(OutboxRecord { .timestamp = (uint32_t)time(nullptr),
+          .value = event.value,
+          .event = event.event });
+      return;
+    }
+#endif
+    ESP_LOGE(TAG, "ignoring event %s", desc.topic);
+    return;
+  }
+#if CONFIG_MQTT_AGGREGATED_TELEMETRY && !CONFIG_MQTT_PER_METRIC_TOPICS
+  if (desc.payload == EVENT_PAYLOAD_FLOAT) {
+    return;
+  }
+#endif
+  if (publishLane(desc) == PUBLISH_TELEMETRY) {
+    xSemaphoreTake(_scheduler_lock, portMAX_DELAY);
+    bool admitted = _deferred.empty() && admit(esp_timer_get_time());
+    if (!admitted) {
+      _deferred.defer(event);
+      _deferrals++;
+    }
+    xSemaphoreGive(_scheduler_lock);
+    if (!admitted) {
+      return;
     }
-    snprintf(topic, TOPIC_LEN, MQTT_PREFIX "/%s", eventName);
-    ESP_LOGI(TAG, "%s %s", topic, eventData);
-    esp_mqtt_client_enqueue(
-        client, topic, eventData, strlen(eventData), 1, retain, false);
+  }
+  publish(event);
+}
+
+// Telemetry goes out within the token bucket, and only while the client's
+// outbox stays below CONFIG_MQTT_CLIENT_OUTBOX_LIMIT, so a burst of readings
+// neither floods the broker nor piles up in RAM ahead of a touch. Caller
+// holds _scheduler_lock.
+bool MqttEventObserver::admit(int64_t now_us)
+{
+  return esp_mqtt_client_get_outbox_size(client)
+      <= CONFIG_MQTT_CLIENT_OUTBOX_LIMIT
+      && _bucket.take(now_us);
+}
+
+bool MqttEventObserver::flushDeferred()
+{
+  xSemaphoreTake(_scheduler_lock, portMAX_DELAY);
+  int64_t now = esp_timer_get_time();
+  while (mqtt_connected && !_deferred.empty() && admit(now)) {
+    publish(_deferred.front());
+    _deferred.pop();
+  }
+  bool left = !_deferred.empty();
+  xSemaphoreGive(_scheduler_lock);
+  return left;
+}
+
+void MqttEventObserver::publish(const Event& event)
+{
+  const EventDescriptor& desc = EVENT_DESCRIPTORS[event.event];
+#if CONFIG_EVENTS_INSTRUMENTATION
+  uint32_t start = esp_cpu_get_ccount();
+#endif
+  char data[FORMAT_BUFSIZE];
+  std::string_view eventData = formatPayload(event, data);
+  const char* topic = MQTT_EVENT_TOPICS[event.event];
+#if CONFIG_EVENTS_INSTRUMENTATION
+  uint32_t formatted = esp_cpu_get_ccount();
+#endif
+  ESP_LOGD(TAG, "%s %.*s", topic, (int)eventData.size(), eventData.data());
+  PublishLane lane = publishLane(desc);
+  traceEvent(TRACE_MQTT_ENQUEUE_BEGIN, event.event);
+  switch (lane) {
+  case PUBLISH_INTERACTIVE:
+    // written to the socket from this task, not queued behind telemetry
+    mqttPublish(topic, eventData.data(), eventData.size(), 0, desc.retain);
+    break;
+  case PUBLISH_TELEMETRY:
+    // QoS0 messages are only queued when stored
+    mqttEnqueue(topic, eventData.data(), eventData.size(),
+        CONFIG_MQTT_TELEMETRY_QOS, desc.retain, true);
+    break;
+  default:
+    mqttEnqueue(
+        topic, eventData.data(), eventData.size(), 1, desc.retain, false);
+    break;
+  }
+  traceEvent(TRACE_MQTT_ENQUEUE_END, event.event);
+#if CONFIG_EVENTS_INSTRUMENTATION
+  formatCycles.record(formatted - start);
+  (lane == PUBLISH_INTERACTIVE ? fastLaneCycles : enqueueCycles)
+      .record(esp_cpu_get_ccount() - formatted);
+#endif
+}
+
+#if CONFIG_MQTT_OUTBOX
+// Publishes the oldest buffered reading on barlog/<host>/history as
+// "<metric> <unix time> <value>", one at a time and at most
+// CONFIG_MQTT_OUTBOX_REPLAY_RATE a second, unless live messages are still
+// waiting in the client's outbox; returns whether readings are left.
+static bool replayHistory()
+{
+  constexpr int LIVE_BACKLOG_BYTES = 1024;
+  int64_t now = esp_timer_get_time();
+  if (now < nextReplayUs
+      || (replayMsgId > 0 && now - replaySentUs < REPLAY_ACK_TIMEOUT_US)) {
+    return true;
+  }
+  OutboxRecord record;
+  if (!outbox.peek(record)) {
+    replayMsgId = 0;
+    return false;
+  }
+  if (record.event >= EVENT_MAX
+      || EVENT_DESCRIPTORS[record.event].payload != EVENT_PAYLOAD_FLOAT) {
+    ESP_LOGE(TAG, "Dropping history of unknown event %u", record.event);
+    outbox.pop(record);
+    return true;
+  }
+  if (esp_mqtt_client_get_outbox_size(client) > LIVE_BACKLOG_BYTES) {
+    return true;
+  }
+  const EventDescriptor& desc = EVENT_DESCRIPTORS[record.event];
+  char data[48];
+  size_t len = std::min(strlen(desc.topic), sizeof(data) - 26);
+  memcpy(data, desc.topic, len);
+  data[len++] = ' ';
+  len += formatUnsigned(data + len, record.timestamp);
+  data[len++] = ' ';
+  len += formatFixed(data + len, record.value, desc.decimals);
+  int msg_id = mqttEnqueue(MQTT_PREFIX "/history", data, len, 1, 0, true);
+  if (msg_id > 0) {
+    replayRecord = record;
+    replaySentUs = now;
+    replayMsgId = msg_id;
+  }
+  nextReplayUs = now + 1000 * 1000 / CONFIG_MQTT_OUTBOX_REPLAY_RATE;
+  return true;
+}
+#endif
+
+// Stopping the client does not post MQTT_EVENT_DISCONNECTED, do its part.
+static void stopClient()
+{
+  esp_mqtt_client_stop(client);
+  if (mqtt_connected) {
+#if CONFIG_MQTT_STATS
+    mqttStats.disconnected(esp_timer_get_time());
+#endif
+    onMqttDisconnectedEvent();
   }
 }
 
+static TickType_t ticksUntil(int64_t deadline_us, int64_t now_us)
+{
+  return pdMS_TO_TICKS((deadline_us - now_us) / 1000) + 1;
+}
+
+#if CONFIG_MQTT_STATS
+static void publishMqttStats()
+{
+  static char doc[768];
+#if CONFIG_MQTT_OBSERVER_WORKER
+  mqttStats.inboxDropped(observerWorker.stats().dropped);
+#endif
+  int len = mqttStats.format(doc, sizeof(doc), esp_timer_get_time());
+  len = std::min(len, (int)sizeof(doc) - 1);
+  mqttEnqueue(MQTT_PREFIX "/mqtt_stats", doc, len, 0, 0, true);
+}
+#endif
+
 void mqttTask(void* h)
 {
   ESP_LOGI(TAG, "Starting up");
+  brokers.begin();
+  brokers.selectReachable(CONFIG_MQTT_PROBE_TIMEOUT);
   esp_mqtt_client_config_t mqtt_cfg = {
-    .uri = CONFIG_BROKER_URL,
+    .uri = brokers.current(),
+#if CONFIG_MQTT_PERSISTENT_SESSION
+    .client_id = "sc-" CONFIG_HOSTNAME,
+#endif
     .lwt_topic = MQTT_PREFIX "/heartbeat",
     .lwt_msg = "offline",
     .lwt_qos = 1,
-    .lwt_retain = 1
+    .lwt_retain = 1,
+#if CONFIG_MQTT_PERSISTENT_SESSION
+    .disable_clean_session = 1,
+#endif
+    .keepalive = CONFIG_MQTT_KEEPALIVE,
   };
 
   needSubscribe = true;
-  static MqttEventObserver observer;
-  events.registerObserver(&observer);
+#if CONFIG_MQTT_STATE_SNAPSHOT
+  if (stateLock == nullptr) {
+    stateLock = xSemaphoreCreateMutex();
+  }
+#endif
+#if CONFIG_MQTT_STATS
+  mqttStats.begin();
+  constexpr int64_t STATS_INTERVAL_US
+      = (int64_t)CONFIG_MQTT_STATS_INTERVAL * 1000 * 1000;
+  int64_t nextStatsUs = esp_timer_get_time() + STATS_INTERVAL_US;
+#endif
+  constexpr int64_t FAILBACK_INTERVAL_US
+      = (int64_t)CONFIG_MQTT_FAILBACK_INTERVAL * 1000 * 1000;
+  int64_t nextFailbackUs = esp_timer_get_time() + FAILBACK_INTERVAL_US;
+#if CONFIG_MQTT_OUTBOX
+  outbox.begin();
+#endif
+#if CONFIG_MQTT_COMMAND_STATS
+  ESP_ERROR_CHECK(heap_trace_init_standalone(
+      commandTraceRecords, COMMAND_TRACE_RECORDS));
+#endif
+#if CONFIG_MQTT_OBSERVER_WORKER
+  if (!observerWorker.start("mqttObserver", 4096, 1, 0)) {
+    ESP_LOGE(TAG, "Cannot start the observer worker, publishing inline");
+  }
+#endif
+  events.registerObserver(&eventsObserver, MQTT_EVENT_MASK);
 
   client = esp_mqtt_client_init(&mqtt_cfg);
   esp_mqtt_client_register_event(client,
@@ -446,17 +1277,95 @@ void mqttTask(void* h)
   esp_mqtt_client_start(client);
 
   uint32_t bits;
-  while (
-      pdTRUE == xTaskNotifyWait(ULONG_MAX, ULONG_MAX, &bits, portMAX_DELAY)) {
-    if (!wifi_connected) {
-      break; // terminate this task so it will be recreated when wifi is back
+  bool clientStopped = false;
+  while (true) {
+    TickType_t wait = portMAX_DELAY;
+#if CONFIG_MQTT_OUTBOX
+    if (mqtt_connected && replayHistory()) {
+      wait = pdMS_TO_TICKS(1000 / CONFIG_MQTT_OUTBOX_REPLAY_RATE);
+    }
+#endif
+    // telemetry held back by the token bucket goes out as tokens come back,
+    // even when no new event comes to push it
+    if (mqtt_connected && observer.flushDeferred()) {
+      wait = std::min<TickType_t>(
+          wait, pdMS_TO_TICKS(1000 / CONFIG_MQTT_PUBLISH_RATE) + 1);
+    }
+    int64_t now = esp_timer_get_time();
+#if CONFIG_MQTT_STATS
+    if (now >= nextStatsUs) {
+      if (mqtt_connected) {
+        publishMqttStats();
+      }
+      nextStatsUs = now + STATS_INTERVAL_US;
+    }
+    wait = std::min(wait, ticksUntil(nextStatsUs, now));
+#endif
+    // while on a fallback broker, go back to the primary once it answers
+    if (!brokers.onPrimary()) {
+      if (now >= nextFailbackUs) {
+        if (probeBroker(brokers.primary(), CONFIG_MQTT_PROBE_TIMEOUT)) {
+          ESP_LOGI(TAG, "Primary broker is back");
+          brokers.select(0);
+          xTaskNotify(mqttTaskHandle, NOTIFY_SWITCH_BROKER, eSetBits);
+        }
+        nextFailbackUs = esp_timer_get_time() + FAILBACK_INTERVAL_US;
+      }
+      wait = std::min(wait, ticksUntil(nextFailbackUs, now));
+    }
+    if (pdTRUE != xTaskNotifyWait(ULONG_MAX, ULONG_MAX, &bits, wait)) {
+      continue;
+    }
+#if CONFIG_MQTT_OUTBOX
+    if (bits & NOTIFY_HISTORY_ACKED) {
+      outbox.pop(replayRecord);
+      replayMsgId = 0;
+    }
+#endif
+#if CONFIG_MQTT_STATS
+    if ((bits & NOTIFY_PUBLISH_STATS) && mqtt_connected) {
+      publishMqttStats();
+    }
+#endif
+    // both bits may be set by the time we wake up: a connection made since
+    // a loss leaves mqtt_connected set, one lost since still counts
+    if (bits & NOTIFY_CONNECTED) {
+      brokers.connected();
+      if (brokerLostUs) {
+        ESP_LOGI(TAG, "Connected to %s %lld ms after losing the broker",
+            brokers.current(), (esp_timer_get_time() - brokerLostUs) / 1000);
+        brokerLostUs = 0;
+      }
+    }
+    if ((bits & NOTIFY_BROKER_LOST) && !mqtt_connected) {
+      if (brokerLostUs == 0) {
+        brokerLostUs = esp_timer_get_time();
+      }
+      // WiFi being down, even for one of the drops wifiTask retries through,
+      // is not the broker's fault
+      if (wifi_link_up && brokers.failed()) {
+        ESP_LOGW(TAG, "Failing over to %s", brokers.current());
+        bits |= NOTIFY_SWITCH_BROKER;
+      }
+    }
+    // the client, and with CONFIG_MQTT_PERSISTENT_SESSION the session the
+    // broker keeps for it, outlive WiFi drops: it is only paused until
+    // wifiTask tells us WiFi is back, while the observer stays registered
+    // and keeps readings in the outbox. A switch to another broker stops
+    // it too, which also resets its reconnect backoff; it is then started
+    // once, on the new URI, if WiFi is up.
+    bool switchBroker = bits & NOTIFY_SWITCH_BROKER;
+    if (!clientStopped && (switchBroker || !wifi_connected)) {
+      stopClient();
+      clientStopped = true;
+    }
+    if (switchBroker) {
+      esp_mqtt_client_set_uri(client, brokers.current());
+      nextFailbackUs = esp_timer_get_time() + FAILBACK_INTERVAL_US;
+    }
+    if (clientStopped && wifi_connected) {
+      esp_mqtt_client_start(client);
+      clientStopped = false;
     }
   }
-
-  ESP_LOGI(TAG, "Terminating task.");
-  esp_mqtt_client_stop(client);
-  esp_mqtt_client_destroy(client);
-  events.unregisterObserver(&observer);
-  mqttTaskHandle = NULL;
-  vTaskDelete(nullptr);
 }
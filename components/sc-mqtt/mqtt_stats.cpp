@@ -0,0 +1,176 @@
+
+#include "mqtt_stats.h"
+#include <esp_heap_caps.h>
+#include <stdio.h>
+
+#if CONFIG_MQTT_STATS
+
+bool MqttStats::begin()
+{
+  if (_lock == nullptr) {
+    _lock = xSemaphoreCreateMutex();
+  }
+  return _lock != nullptr;
+}
+
+// caller holds _lock
+void MqttStats::track(int msg_id, bool subscribe, int64_t now_us)
+{
+  Pending& slot = _pending[_next];
+  if (slot.msg_id) {
+    _untracked++;
+  }
+  slot = Pending { msg_id, (uint32_t)now_us, subscribe };
+  _next = (_next + 1) % PENDING;
+}
+
+void MqttStats::sent(int msg_id, int qos, int outbox_bytes, int64_t now_us)
+{
+  if (_lock == nullptr) {
+    return;
+  }
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  if (msg_id < 0) {
+    _dropped++;
+  } else {
+    _published++;
+    if (qos > 0 && msg_id > 0) {
+      track(msg_id, false, now_us);
+    }
+  }
+  _outbox_bytes = outbox_bytes;
+  if (outbox_bytes > _outbox_peak) {
+    _outbox_peak = outbox_bytes;
+  }
+  xSemaphoreGive(_lock);
+}
+
+void MqttStats::subscribed(int msg_id, int64_t now_us)
+{
+  if (_lock == nullptr || msg_id <= 0) {
+    return;
+  }
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  track(msg_id, true, now_us);
+  xSemaphoreGive(_lock);
+}
+
+void MqttStats::acked(int msg_id, int64_t now_us)
+{
+  if (_lock == nullptr || msg_id <= 0) {
+    return;
+  }
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  for (Pending& slot : _pending) {
+    if (slot.msg_id == msg_id) {
+      uint32_t rtt = (uint32_t)now_us - slot.sent_us;
+      if (slot.subscribe) {
+        _suback_us.record(rtt);
+      } else {
+        _puback_us.record(rtt);
+        _acked++;
+      }
+      slot.msg_id = 0;
+      break;
+    }
+  }
+  xSemaphoreGive(_lock);
+}
+
+void MqttStats::expired()
+{
+  if (_lock == nullptr) {
+    return;
+  }
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _expired++;
+  xSemaphoreGive(_lock);
+}
+
+void MqttStats::error()
+{
+  if (_lock == nullptr) {
+    return;
+  }
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _errors++;
+  xSemaphoreGive(_lock);
+}
+
+void MqttStats::connected(int64_t now_us)
+{
+  if (_lock == nullptr) {
+    return;
+  }
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  if (_down_since_us) {
+    _down_total_us += now_us - _down_since_us;
+    _down_since_us = 0;
+  }
+  _connects++;
+  xSemaphoreGive(_lock);
+}
+
+void MqttStats::disconnected(int64_t now_us)
+{
+  if (_lock == nullptr) {
+    return;
+  }
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  if (_down_since_us == 0) {
+    _down_since_us = now_us;
+  }
+  // the acks of what was in flight will not come on this connection
+  for (Pending& slot : _pending) {
+    slot.msg_id = 0;
+  }
+  xSemaphoreGive(_lock);
+}
+
+void MqttStats::inboxDropped(uint32_t dropped)
+{
+  if (_lock == nullptr) {
+    return;
+  }
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  _inbox_dropped = dropped;
+  xSemaphoreGive(_lock);
+}
+
+int MqttStats::format(char* buf, size_t len, int64_t now_us)
+{
+  if (_lock == nullptr) {
+    return snprintf(buf, len, "{}");
+  }
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  int64_t down_us = _down_total_us
+      + (_down_since_us ? now_us - _down_since_us : 0);
+  int total = snprintf(buf, len,
+      "{\"published\":%u,\"acked\":%u,\"untracked\":%u,\"dropped\":%u,"
+      "\"expired\":%u,\"inbox_dropped\":%u,\"errors\":%u,"
+      "\"outbox_bytes\":%d,\"outbox_peak\":%d,\"reconnects\":%u,"
+      "\"disconnected_s\":%u,\"min_free_heap\":%u,\"puback_us_log2\":[",
+      _published, _acked, _untracked, _dropped, _expired, _inbox_dropped,
+      _errors, _outbox_bytes, _outbox_peak, _connects ? _connects - 1 : 0,
+      (unsigned)(down_us / 1000000),
+      (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_DEFAULT));
+  auto append = [&](const Log2Histogram<24>& h, const char* after) {
+    size_t used = (size_t)total < len ? (size_t)total : len;
+    int n = h.format(buf + used, len - used);
+    // the histogram separates its buckets with spaces
+    for (size_t i = used; i < used + n && i < len; i++) {
+      if (buf[i] == ' ') {
+        buf[i] = ',';
+      }
+    }
+    total += n;
+    used = (size_t)total < len ? (size_t)total : len;
+    total += snprintf(buf + used, len - used, "%s", after);
+  };
+  append(_puback_us, "],\"suback_us_log2\":[");
+  append(_suback_us, "]}");
+  xSemaphoreGive(_lock);
+  return total;
+}
+
+#endif
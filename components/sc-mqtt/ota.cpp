@@ -3,6 +3,8 @@
 #include <esp_log.h>
 #include <esp_ota_ops.h>
 #include <esp_partition.h>
+#include <esp_spi_flash.h>
+#include <esp_timer.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include "events.h"
@@ -13,6 +15,9 @@ static const char* TAG = "OTA";
 
 const esp_partition_t* part;
 esp_ota_handle_t ota_handle;
+static int64_t ota_started_us;
+static int64_t ota_write_us; // in esp_ota_write, which erases as it goes
+static bool ota_failed;
 
 esp_err_t http_event_handler(esp_http_client_event_t* evt)
 {
@@ -22,8 +27,13 @@ esp_err_t http_event_handler(esp_http_client_event_t* evt)
     ESP_LOGD(TAG, "HTTP_EVENT_ERROR");
     break;
   case HTTP_EVENT_ON_CONNECTED:
-    ESP_ERROR_CHECK(esp_ota_begin(part, OTA_SIZE_UNKNOWN, &ota_handle));
+    // sectors are erased by esp_ota_write just ahead of the data, while the
+    // next chunk downloads, rather than the whole slot up front
+    ESP_ERROR_CHECK(
+        esp_ota_begin(part, OTA_WITH_SEQUENTIAL_WRITES, &ota_handle));
     ota_offset = 0;
+    ota_write_us = 0;
+    ota_failed = false;
     ESP_LOGI(TAG, "Started downloading");
     buzzer.playOtaDownloading();
     break;
@@ -34,18 +44,39 @@ esp_err_t http_event_handler(esp_http_client_event_t* evt)
     ESP_LOGD(TAG, "HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key,
         evt->header_value);
     break;
-  case HTTP_EVENT_ON_DATA:
+  case HTTP_EVENT_ON_DATA: {
     ESP_LOGD(TAG, "HTTP_EVENT_ON_DATA, len=%d", evt->data_len);
-    esp_ota_write_with_offset(
-        ota_handle, evt->data, evt->data_len, ota_offset);
+    if (ota_failed) {
+      break;
+    }
+    int64_t start = esp_timer_get_time();
+    auto err = esp_ota_write(ota_handle, evt->data, evt->data_len);
+    ota_write_us += esp_timer_get_time() - start;
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG, "Writing at offset %u failed: %s", ota_offset,
+          esp_err_to_name(err));
+      ota_failed = true;
+      break;
+    }
     ota_offset += evt->data_len;
     // buzzer.playOtaDownloading();
-    break;
+  } break;
   case HTTP_EVENT_ON_FINISH:
     ESP_LOGD(TAG, "HTTP_EVENT_ON_FINISH");
     break;
   case HTTP_EVENT_DISCONNECTED: {
-    ESP_LOGI(TAG, "Finished downloading %d bytes", ota_offset);
+    ESP_LOGI(TAG, "Finished downloading %u bytes", ota_offset);
+    ESP_LOGI(TAG, "OTA took %lld ms, %lld ms of it writing; erased %u of %u "
+        "bytes", (esp_timer_get_time() - ota_started_us) / 1000,
+        ota_write_us / 1000,
+        (ota_offset + SPI_FLASH_SEC_SIZE - 1) & ~(SPI_FLASH_SEC_SIZE - 1),
+        part->size);
+    if (ota_failed) {
+      esp_ota_abort(ota_handle);
+      buzzer.playOtaFailed();
+      events.postOtaDoneFail();
+      break;
+    }
     auto err = esp_ota_end(ota_handle);
     if (ESP_OK == err) {
       ESP_LOGI(TAG,
@@ -54,8 +85,10 @@ esp_err_t http_event_handler(esp_http_client_event_t* evt)
       events.postOtaDoneOk();
       vTaskDelay(pdMS_TO_TICKS(500)); // allow for MQTT event to go out
       esp_restart();
-    } else if (ESP_ERR_OTA_VALIDATE_FAILED) {
-      ESP_LOGE(TAG, "Image validation failed");
+    } else {
+      ESP_LOGE(TAG, "%s", err == ESP_ERR_OTA_VALIDATE_FAILED
+              ? "Image validation failed"
+              : esp_err_to_name(err));
       buzzer.playOtaFailed();
       events.postOtaDoneFail();
     }
@@ -67,12 +100,12 @@ esp_err_t http_event_handler(esp_http_client_event_t* evt)
 void otaTask(void*)
 {
   ESP_LOGI(TAG, "start");
+  ota_started_us = esp_timer_get_time();
   buzzer.playOtaStart();
   events.postOtaStarted();
 
   part = esp_ota_get_next_update_partition(esp_ota_get_running_partition());
   ESP_LOGI(TAG, "Writing to partition %s", part->label);
-  ESP_ERROR_CHECK(esp_partition_erase_range(part, 0, part->size));
 
 #pragma GCC diagnostic ignored "-Wmissing-field-initializers"
   esp_http_client_config_t http_config
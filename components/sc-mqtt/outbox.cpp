@@ -0,0 +1,226 @@
+
+#include "outbox.h"
+#include <esp_log.h>
+#include <stdio.h>
+#include <string.h>
+
+#if CONFIG_MQTT_OUTBOX
+
+static const char* TAG = "OUTBOX";
+static const char* META_KEY = "meta";
+static const char* LAYOUT_KEY = "layout";
+
+// FNV-1a of what a stored record's event value and the ring positions mean:
+// the event registry order, which CONFIG_HAS_EXTERNAL_SENSOR and registry
+// edits shift, and the ring geometry
+static constexpr uint32_t outboxLayout()
+{
+  uint32_t hash = 2166136261u;
+  auto mix = [&hash](uint32_t byte) { hash = (hash ^ byte) * 16777619u; };
+  for (const EventDescriptor& desc : EVENT_DESCRIPTORS) {
+    for (const char* p = desc.topic; *p; p++) {
+      mix((uint8_t)*p);
+    }
+    mix(desc.payload);
+  }
+  mix(sizeof(OutboxRecord));
+  mix(CONFIG_MQTT_OUTBOX_CHUNKS);
+  mix(CONFIG_MQTT_OUTBOX_CHUNK_RECORDS);
+  return hash;
+}
+
+bool Outbox::begin()
+{
+  if (_lock != nullptr) {
+    return true;
+  }
+  esp_err_t err = nvs_open("outbox", NVS_READWRITE, &_nvs);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Cannot open NVS: %s", esp_err_to_name(err));
+    return false;
+  }
+  if (!checkLayout()) {
+    return false;
+  }
+  size_t len = sizeof(_meta);
+  if (nvs_get_blob(_nvs, META_KEY, &_meta, &len) != ESP_OK
+      || len != sizeof(_meta) || _meta.head >= CHUNKS
+      || _meta.count > CHUNKS || _meta.read >= CHUNK_RECORDS) {
+    _meta = {};
+  }
+  _lock = xSemaphoreCreateMutex();
+  if (_meta.count) {
+    ESP_LOGI(TAG, "%u chunks left from an earlier boot", _meta.count);
+  }
+  return _lock != nullptr;
+}
+
+// drops what an earlier firmware left if its records mean something else
+bool Outbox::checkLayout()
+{
+  uint32_t layout = 0;
+  if (nvs_get_u32(_nvs, LAYOUT_KEY, &layout) == ESP_OK
+      && layout == outboxLayout()) {
+    return true;
+  }
+  esp_err_t err = nvs_erase_all(_nvs);
+  if (err == ESP_OK) {
+    err = nvs_set_u32(_nvs, LAYOUT_KEY, outboxLayout());
+  }
+  if (err == ESP_OK) {
+    err = nvs_commit(_nvs);
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Cannot reset NVS: %s", esp_err_to_name(err));
+    return false;
+  }
+  ESP_LOGI(TAG, "Event registry changed, outbox reset");
+  return true;
+}
+
+void Outbox::chunkKey(size_t chunk, char* key)
+{
+  snprintf(key, 8, "c%u", (unsigned)chunk);
+}
+
+void Outbox::saveMeta()
+{
+  nvs_set_blob(_nvs, META_KEY, &_meta, sizeof(_meta));
+  nvs_commit(_nvs);
+}
+
+void Outbox::push(const OutboxRecord& record)
+{
+  if (_lock == nullptr) {
+    return;
+  }
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  if (_tail_count == CHUNK_RECORDS && _tail_read > 0) {
+    memmove(_tail, _tail + _tail_read,
+        (_tail_count - _tail_read) * sizeof(OutboxRecord));
+    _tail_count -= _tail_read;
+    _tail_read = 0;
+  }
+  if (_tail_count == CHUNK_RECORDS) {
+    if (_meta.count == CHUNKS) {
+      // overwrite the oldest chunk
+      _evicted += CHUNK_RECORDS - _meta.read;
+      _meta.head = (_meta.head + 1) % CHUNKS;
+      _meta.count--;
+      _meta.read = 0;
+      _head_loaded = false;
+    }
+    char key[8];
+    chunkKey((_meta.head + _meta.count) % CHUNKS, key);
+    esp_err_t err = nvs_set_blob(_nvs, key, _tail, sizeof(_tail));
+    if (err == ESP_OK) {
+      _meta.count++;
+      saveMeta();
+    } else {
+      ESP_LOGE(TAG, "Cannot write chunk: %s", esp_err_to_name(err));
+      _evicted += CHUNK_RECORDS;
+    }
+    _tail_count = 0;
+  }
+  _tail[_tail_count++] = record;
+  _buffered++;
+  xSemaphoreGive(_lock);
+}
+
+// caller holds _lock
+bool Outbox::loadHead()
+{
+  if (_head_loaded) {
+    return true;
+  }
+  char key[8];
+  chunkKey(_meta.head, key);
+  size_t len = sizeof(_head);
+  esp_err_t err = nvs_get_blob(_nvs, key, _head, &len);
+  if (err != ESP_OK || len != sizeof(_head)) {
+    ESP_LOGE(TAG, "Cannot read chunk %s, dropping it", key);
+    _evicted += CHUNK_RECORDS - _meta.read;
+    _meta.head = (_meta.head + 1) % CHUNKS;
+    _meta.count--;
+    _meta.read = 0;
+    saveMeta();
+    return false;
+  }
+  _head_loaded = true;
+  return true;
+}
+
+bool Outbox::peek(OutboxRecord& record)
+{
+  if (_lock == nullptr) {
+    return false;
+  }
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  bool found = false;
+  while (_meta.count && !found) {
+    if (loadHead()) {
+      record = _head[_meta.read];
+      found = true;
+    }
+  }
+  if (!found && _tail_read < _tail_count) {
+    record = _tail[_tail_read];
+    found = true;
+  }
+  xSemaphoreGive(_lock);
+  return found;
+}
+
+// caller holds _lock
+void Outbox::popHead()
+{
+  if (++_meta.read == CHUNK_RECORDS) {
+    char key[8];
+    chunkKey(_meta.head, key);
+    nvs_erase_key(_nvs, key);
+    _meta.head = (_meta.head + 1) % CHUNKS;
+    _meta.count--;
+    _meta.read = 0;
+    _head_loaded = false;
+    saveMeta();
+  }
+  _replayed++;
+}
+
+void Outbox::pop(const OutboxRecord& record)
+{
+  if (_lock == nullptr) {
+    return;
+  }
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  if (_meta.count) {
+    if (_head_loaded
+        && memcmp(&_head[_meta.read], &record, sizeof(record)) == 0) {
+      popHead();
+    }
+  } else if (_tail_read < _tail_count
+      && memcmp(&_tail[_tail_read], &record, sizeof(record)) == 0) {
+    if (++_tail_read == _tail_count) {
+      _tail_read = _tail_count = 0;
+    }
+    _replayed++;
+  }
+  xSemaphoreGive(_lock);
+}
+
+OutboxStats Outbox::stats()
+{
+  if (_lock == nullptr) {
+    return {};
+  }
+  xSemaphoreTake(_lock, portMAX_DELAY);
+  OutboxStats st { .buffered = _buffered,
+    .replayed = _replayed,
+    .evicted = _evicted,
+    .pending = (uint32_t)(_meta.count * CHUNK_RECORDS - _meta.read
+        + _tail_count - _tail_read) };
+  xSemaphoreGive(_lock);
+  return st;
+}
+
+#endif
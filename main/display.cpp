@@ -14,6 +14,7 @@
 #include "sensors.h"
 #endif
 #include "backlight.h"
+#include "event_trace.h"
 #include "events.h"
 #include "statusbar.h"
 
@@ -37,6 +38,10 @@ static void lv_tick_task(void*) { lv_tick_inc(LV_TICK_PERIOD_MS); }
 
 lv_color_t* buf1 = nullptr;
 
+// logged every minute, to see what a sensor cycle costs the display
+static uint32_t refresh_passes = 0;
+static uint32_t flushed_bytes = 0;
+
 struct TouchedAnimation {
   lv_obj_t* _anim_circle = nullptr;
   void start(lv_point_t p)
@@ -61,6 +66,11 @@ struct DisplayEventObserver : public EventObserver {
     if (event.event == EVENT_SCREEN_TOUCHED) {
     }
   }
+  // one refresh pass for a whole BSEC run rather than one per reading
+  virtual void noticeBatch(const Event*, size_t) override
+  {
+    xTaskNotify(displayTaskHandle, DISPLAY_UPDATE_WIDGETS, eSetBits);
+  }
   virtual const char* name() override { return "display"; }
 };
 
@@ -84,6 +94,7 @@ void display_flush(
 {
   const uint32_t w = (area->x2 - area->x1 + 1);
   const uint32_t h = (area->y2 - area->y1 + 1);
+  traceEvent(TRACE_DISPLAY_FLUSH_BEGIN, 0, h);
   BufferInfo bi;
   bi.buffer = (uint8_t*)color_p, bi.bitsPerPixel = BITS_PER_PIXEL,
   bi.palette
@@ -93,8 +104,10 @@ void display_flush(
   bi.bufferWidth = w, bi.bufferHeight = h, bi.isPartialUpdate = true;
 
   lcd.writeBuffer(&bi);
+  flushed_bytes += w * h * BITS_PER_PIXEL / 8;
 
   lv_disp_flush_ready(disp);
+  traceEvent(TRACE_DISPLAY_FLUSH_END, 0, h);
 }
 
 void touch_screen_input(lv_indev_drv_t* drv, lv_indev_data_t* data);
@@ -168,7 +181,9 @@ void displayTask(void*)
   StatusBar status_bar(lv_scr_act());
   MainPanel main_panel(lv_scr_act());
 
-  events.registerObserver(&displayEventObserver);
+  // heartbeats and OTA progress do not change anything on screen
+  events.registerObserver(&displayEventObserver,
+      EVENT_MASK_SENSORS | eventMask(EVENT_SCREEN_TOUCHED));
 
   // label = lv_label_create(lv_scr_act());
   // lv_label_set_long_mode(label, LV_LABEL_LONG_WRAP);
@@ -221,14 +236,22 @@ void displayTask(void*)
       if (notif_flags & DISPLAY_NOTIFY_TOUCH) {
         lv_task_handler();
       }
-      auto current_minute = (time(0) % 3600) / 60;
-      if ((notif_flags & DISPLAY_UPDATE_WIDGETS)
-          || (last_minute != current_minute)) {
-        last_minute = current_minute;
-        status_bar.update();
-        main_panel.update();
-        lv_task_handler();
+    }
+    // the clock must not depend on some event waking us up
+    auto current_minute = (time(0) % 3600) / 60;
+    if ((notif_flags & DISPLAY_UPDATE_WIDGETS)
+        || (last_minute != current_minute)) {
+      if (last_minute != current_minute) {
+        ESP_LOGI(TAG, "refresh passes: %u, flushed: %u bytes",
+            refresh_passes, flushed_bytes);
+        refresh_passes = 0;
+        flushed_bytes = 0;
       }
+      last_minute = current_minute;
+      refresh_passes++;
+      status_bar.update();
+      main_panel.update();
+      lv_task_handler();
     }
   }
 }
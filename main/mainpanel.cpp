@@ -20,6 +20,22 @@ static lv_obj_t* ext_temp_label = nullptr;
 static lv_obj_t* ext_humidity_panel = nullptr;
 static lv_obj_t* ext_humidity_label = nullptr;
 
+// the readings shown on the panel; it observes exactly these events
+struct PanelField {
+  WallControllerEvent event;
+  void (MainPanel::*set)(float);
+};
+static constexpr PanelField PANEL_FIELDS[] = {
+  { EVENT_SENSOR_TEMPERATURE, &MainPanel::setTemp },
+  { EVENT_SENSOR_HUMIDITY, &MainPanel::setHumidity },
+#ifdef CONFIG_HAS_EXTERNAL_SENSOR
+  { EVENT_SENSOR_EXT_TEMPERATURE, &MainPanel::setExtTemp },
+  { EVENT_SENSOR_EXT_HUMIDITY, &MainPanel::setExtHumidity },
+#endif
+  { EVENT_SENSOR_IAQ, &MainPanel::setIAQ },
+  { EVENT_SENSOR_CO2, &MainPanel::setCO2 },
+};
+
 LV_FONT_DECLARE(monofur);
 
 void create_temp_panel(lv_obj_t* parent, int x, int y, int w, int h)
@@ -298,7 +314,11 @@ MainPanel::MainPanel(lv_obj_t* parent)
 
   create_spinner(parent);
 
-  events.registerObserver(this);
+  EventMask mask = 0;
+  for (const auto& field : PANEL_FIELDS) {
+    mask |= eventMask(field.event);
+  }
+  events.registerObserver(this, mask);
 }
 
 void MainPanel::update()
@@ -423,29 +443,10 @@ void MainPanel::setIAQ(float iaq)
 
 void MainPanel::notice(const Event& event)
 {
-  switch (event.event) {
-  case EVENT_SENSOR_TEMPERATURE:
-    setTemp(event.air_temperature);
-    break;
-  case EVENT_SENSOR_HUMIDITY:
-    setHumidity(event.air_humidity);
-    break;
-#ifdef CONFIG_HAS_EXTERNAL_SENSOR
-  case EVENT_SENSOR_EXT_TEMPERATURE:
-    setExtTemp(event.air_temperature); // event field is reused for external sensor
-    break;
-  case EVENT_SENSOR_EXT_HUMIDITY:
-    setExtHumidity(event.air_humidity); // event field is reused for external sensor
-    break;
-#endif
-  case EVENT_SENSOR_IAQ:
-    setIAQ(event.air_iaq);
-    break;
-  case EVENT_SENSOR_CO2:
-    setCO2(event.air_co2);
-    break;
-  default:
-    // ignore other events
-    break;
+  for (const auto& field : PANEL_FIELDS) {
+    if (field.event == event.event) {
+      (this->*field.set)(event.value);
+      return;
+    }
   }
 }
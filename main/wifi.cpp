@@ -5,6 +5,7 @@
 #include "freertos/task.h"
 #include <esp_log.h>
 #include <esp_ota_ops.h>
+#include <atomic>
 #include <stdlib.h>
 
 #include "esp_event.h"
@@ -12,6 +13,7 @@
 #include "esp_wifi.h"
 #include <cstring>
 #include <esp_sntp.h>
+#include <esp_timer.h>
 #include <time.h>
 
 #include "lwip/err.h"
@@ -35,6 +37,10 @@ void mqttTask(void*);
 void eventsTask(void*);
 static int s_retry_num = 0;
 bool wifi_connected = false;
+// whether the station is associated and has an address right now;
+// wifi_connected only goes false after the retries below are exhausted
+std::atomic<bool> wifi_link_up { false };
+int64_t ip_acquired_us = 0;
 
 static void event_handler(void* arg, esp_event_base_t event_base,
     int32_t event_id, void* event_data)
@@ -44,6 +50,7 @@ static void event_handler(void* arg, esp_event_base_t event_base,
     esp_wifi_connect();
   } else if (event_base == WIFI_EVENT
       && event_id == WIFI_EVENT_STA_DISCONNECTED) {
+    wifi_link_up = false;
     if (s_retry_num < 10) {
       esp_wifi_connect();
       s_retry_num++;
@@ -56,6 +63,8 @@ static void event_handler(void* arg, esp_event_base_t event_base,
     ip_event_got_ip_t* event = (ip_event_got_ip_t*)event_data;
     ESP_LOGI(TAG, "got ip:" IPSTR, IP2STR(&event->ip_info.ip));
     s_retry_num = 0;
+    ip_acquired_us = esp_timer_get_time();
+    wifi_link_up = true;
     xEventGroupSetBits(s_wifi_event_group, WIFI_CONNECTED_BIT);
   }
 }
@@ -131,6 +140,7 @@ void wifiTask(void*)
       }
 
       ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_MIN_MODEM));
+      wifi_connected = true;
       if (NULL == eventsTaskHandle) {
         xTaskCreatePinnedToCore(
             eventsTask, "eventsTask", 8192, NULL, 1, &eventsTaskHandle, 1);
@@ -138,13 +148,18 @@ void wifiTask(void*)
       if (NULL == mqttTaskHandle) {
         xTaskCreatePinnedToCore(
             mqttTask, "mqttTask", 8192, NULL, 1, &mqttTaskHandle, 0);
+      } else {
+        // the MQTT client outlives WiFi drops, wake it up
+        xTaskNotify(mqttTaskHandle, 0x2, eSetBits);
       }
-      wifi_connected = true;
     } else if (bits & WIFI_FAIL_BIT) {
       ESP_LOGI(TAG, "Failed to connect to SSID:%s, password:%s",
           CONFIG_WIFI_SSID, CONFIG_WIFI_PASS);
       ESP_LOGI(TAG, "wifi stopped");
       wifi_connected = false;
+      if (NULL != mqttTaskHandle) {
+        xTaskNotify(mqttTaskHandle, 0x2, eSetBits); // to pause its client
+      }
       vTaskDelay(pdMS_TO_TICKS(60 * 1000));
       ESP_LOGI(TAG, "Attempting new wifi start");
       s_retry_num = 0;
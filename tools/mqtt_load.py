@@ -0,0 +1,271 @@
+#!/usr/bin/env python3
+"""Load a controller with MQTT commands and report how it copes, as JSON.
+
+Point it at the broker the controller uses, e.g. a mosquitto on loopback
+for a controller running under QEMU, or the house broker for a real one:
+
+    mosquitto -p 1883 &
+    tools/mqtt_load.py --host <host> --duration 60 --ping-rate 20 \\
+        --load display=on@5 --load night_mode=off@50 > run.json
+
+cmd/<host>/ping is sent at --ping-rate and timed from publish to the
+controller's barlog/<host>/pong echo; each --load TOPIC=PAYLOAD@RATE
+floods cmd/<host>/TOPIC on top of that (a topic starting with '/' is taken
+as is). With --correlate, each of those commands carries an id, and is
+timed from publish to its barlog/<host>/ack, which also gives the time the
+firmware spent handling it (CONFIG_MQTT_COMMAND_ACKS). Only commands with
+arguments on cmd/<host>/, such as display or sound, are acked; ping,
+brokers and shared or state topics are not. Everything else the controller
+publishes meanwhile is counted per topic.
+barlog/<host>/mqtt_stats is requested before and after the run for drops,
+expired messages and the heap low-water mark, which needs the firmware
+built with CONFIG_MQTT_STATS.
+
+Needs paho-mqtt (pip install paho-mqtt). Exits with 1 when a --fail-*
+threshold is exceeded, so runs can gate a CI job.
+"""
+
+import argparse
+import json
+import sys
+import threading
+import time
+
+try:
+    import paho.mqtt.client as mqtt
+except ImportError:
+    sys.exit('mqtt_load.py needs paho-mqtt: pip install paho-mqtt')
+
+
+def percentile(values, p):
+    if not values:
+        return None
+    values = sorted(values)
+    k = min(len(values) - 1, max(0, round(p / 100 * (len(values) - 1))))
+    return round(values[k], 3)
+
+
+def parse_load(spec):
+    try:
+        target, rate = spec.rsplit('@', 1)
+        topic, payload = target.split('=', 1)
+        return topic, payload, float(rate)
+    except ValueError:
+        raise argparse.ArgumentTypeError(
+            'expected TOPIC=PAYLOAD@RATE, got %r' % spec)
+
+
+class Run:
+    def __init__(self, args):
+        self.args = args
+        self.prefix = 'barlog/%s' % args.host
+        self.lock = threading.Lock()
+        self.pings = {}  # seq -> monotonic send time
+        self.rtts_ms = []
+        self.late = 0
+        self.commands = {}  # id -> (stream name, monotonic send time)
+        self.acks = {}  # stream name -> {'rtt_ms': [], 'handling_us': []}
+        self.failed_acks = 0
+        self.telemetry = {}
+        self.stats = []
+        self.stats_ready = threading.Event()
+        self.connected = threading.Event()
+
+        try:
+            self.client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2)
+        except AttributeError:  # paho-mqtt < 2.0
+            self.client = mqtt.Client()
+        self.client.on_connect = self.on_connect
+        self.client.on_message = self.on_message
+
+    def command_topic(self, topic):
+        if topic.startswith('/'):
+            return topic[1:]
+        return 'cmd/%s/%s' % (self.args.host, topic)
+
+    def on_connect(self, client, userdata, *args):
+        client.subscribe(self.prefix + '/#', qos=0)
+        self.connected.set()
+
+    def on_message(self, client, userdata, msg):
+        now = time.monotonic()
+        with self.lock:
+            if msg.topic == self.prefix + '/pong':
+                sent = self.pings.pop(msg.payload.decode(errors='replace'),
+                                      None)
+                if sent is None:
+                    self.late += 1
+                else:
+                    self.rtts_ms.append((now - sent) * 1000)
+                return
+            if msg.topic == self.prefix + '/ack':
+                try:
+                    ack = json.loads(msg.payload)
+                    name, sent = self.commands.pop(ack['id'])
+                except (ValueError, KeyError):
+                    return
+                acks = self.acks.setdefault(
+                    name, {'rtt_ms': [], 'handling_us': []})
+                acks['rtt_ms'].append((now - sent) * 1000)
+                acks['handling_us'].append(ack.get('us', 0))
+                if not ack.get('ok'):
+                    self.failed_acks += 1
+                return
+            if msg.topic == self.prefix + '/mqtt_stats':
+                try:
+                    self.stats.append(json.loads(msg.payload))
+                    self.stats_ready.set()
+                except ValueError:
+                    pass
+                return
+            self.telemetry[msg.topic] = self.telemetry.get(msg.topic, 0) + 1
+
+    def request_stats(self):
+        self.stats_ready.clear()
+        self.client.publish(self.command_topic('mqtt_stats'), '', qos=0)
+        if not self.stats_ready.wait(self.args.stats_timeout):
+            return None
+        with self.lock:
+            return self.stats[-1]
+
+    def run(self):
+        args = self.args
+        self.client.connect(args.broker, args.port)
+        self.client.loop_start()
+        if not self.connected.wait(10):
+            sys.exit('cannot connect to %s:%d' % (args.broker, args.port))
+        before = self.request_stats()
+
+        # each stream: topic, payload, period, next due time, count sent
+        start = time.monotonic()
+        streams = []
+        if args.ping_rate > 0:
+            streams.append(['ping', None, 1 / args.ping_rate, start, 0])
+        for topic, payload, rate in args.load:
+            if rate > 0:
+                streams.append([topic, payload, 1 / rate, start, 0])
+        seq = 0
+        end = start + args.duration
+        while streams:
+            stream = min(streams, key=lambda s: s[3])
+            now = time.monotonic()
+            if stream[3] >= end:
+                break
+            if stream[3] > now:
+                time.sleep(stream[3] - now)
+            topic, payload = stream[0], stream[1]
+            if payload is None:
+                payload = str(seq)
+                with self.lock:
+                    self.pings[payload] = time.monotonic()
+                seq += 1
+            elif args.correlate:
+                command_id = '%d.%d' % (streams.index(stream), stream[4])
+                with self.lock:
+                    self.commands[command_id] = ('%s=%s' % (topic, payload),
+                                                 time.monotonic())
+                payload = '#%s %s' % (command_id, payload)
+            self.client.publish(self.command_topic(topic), payload,
+                                qos=args.qos)
+            stream[3] += stream[2]
+            stream[4] += 1
+        elapsed = time.monotonic() - start
+
+        time.sleep(args.drain)
+        after = self.request_stats()
+        self.client.loop_stop()
+        self.client.disconnect()
+
+        with self.lock:
+            rtts = list(self.rtts_ms)
+            lost = len(self.pings)
+            telemetry = dict(self.telemetry)
+            acks = {name: {
+                'received': len(a['rtt_ms']),
+                'p50_ms': percentile(a['rtt_ms'], 50),
+                'p99_ms': percentile(a['rtt_ms'], 99),
+                'handling_p50_us': percentile(a['handling_us'], 50),
+                'handling_p99_us': percentile(a['handling_us'], 99),
+            } for name, a in self.acks.items()}
+            unacked = len(self.commands)
+        sent = {(s[0] if s[1] is None else '%s=%s' % (s[0], s[1])): s[4]
+                for s in streams}
+        result = {
+            'label': args.label,
+            'broker': '%s:%d' % (args.broker, args.port),
+            'host': args.host,
+            'duration_s': round(elapsed, 3),
+            'qos': args.qos,
+            'commands_sent': sent,
+            'ping': {
+                'sent': seq,
+                'received': len(rtts),
+                'lost': lost,
+                'late': self.late,
+                'p50_ms': percentile(rtts, 50),
+                'p90_ms': percentile(rtts, 90),
+                'p99_ms': percentile(rtts, 99),
+                'max_ms': round(max(rtts), 3) if rtts else None,
+            },
+            'published': telemetry,
+            'mqtt_stats_before': before,
+            'mqtt_stats_after': after,
+        }
+        if args.correlate:
+            result['acks'] = acks
+            result['acks_failed'] = self.failed_acks
+            result['unacked'] = unacked
+        if before and after:
+            result['delta'] = {
+                key: after[key] - before[key]
+                for key in ('published', 'acked', 'dropped', 'expired',
+                            'inbox_dropped', 'errors', 'reconnects')
+                if key in before and key in after
+            }
+            result['min_free_heap'] = after.get('min_free_heap')
+            result['outbox_peak'] = after.get('outbox_peak')
+        return result
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--host', required=True,
+                        help='CONFIG_HOSTNAME of the controller')
+    parser.add_argument('--broker', default='localhost')
+    parser.add_argument('--port', type=int, default=1883)
+    parser.add_argument('--duration', type=float, default=30,
+                        help='seconds of load (default 30)')
+    parser.add_argument('--ping-rate', type=float, default=10,
+                        help='timed pings per second (default 10)')
+    parser.add_argument('--load', type=parse_load, action='append',
+                        default=[], metavar='TOPIC=PAYLOAD@RATE',
+                        help='extra command stream, may be repeated')
+    parser.add_argument('--correlate', action='store_true',
+                        help='tag --load commands with an id and time their'
+                        ' acks')
+    parser.add_argument('--qos', type=int, choices=(0, 1), default=0)
+    parser.add_argument('--drain', type=float, default=2,
+                        help='seconds to wait for late answers (default 2)')
+    parser.add_argument('--stats-timeout', type=float, default=5)
+    parser.add_argument('--label', default='',
+                        help='copied to the output, e.g. a commit id')
+    parser.add_argument('--fail-p99-ms', type=float,
+                        help='fail when the ping p99 is above this')
+    parser.add_argument('--fail-lost', type=int,
+                        help='fail when more pings than this are lost')
+    args = parser.parse_args()
+
+    result = Run(args).run()
+    json.dump(result, sys.stdout, indent=2)
+    sys.stdout.write('\n')
+
+    ping = result['ping']
+    failed = (args.fail_p99_ms is not None
+              and (ping['p99_ms'] is None
+                   or ping['p99_ms'] > args.fail_p99_ms)) \
+        or (args.fail_lost is not None and ping['lost'] > args.fail_lost)
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,59 @@
+#!/usr/bin/env python3
+"""Decode barlog/<host>/telemetry documents into JSON lines.
+
+    mosquitto_sub -h bb-master -t barlog/<host>/telemetry -C 1 > doc.bin
+    tools/telemetry_decode.py doc.bin
+"""
+
+import argparse
+import json
+import struct
+import sys
+
+# keep in sync with components/sc-events/include/event_registry.h
+EVENT_NAMES = [
+    'status', 'heartbeat', 'air_temperature', 'air_humidity', 'touched',
+    'gas_status', 'air_iaq', 'air_co2', 'air_voc', 'air_pressure',
+]
+EXT_EVENT_NAMES = ['ext_temperature', 'ext_humidity']
+
+# keep in sync with TelemetryHeader in components/sc-mqtt/mqtt.cpp
+HEADER = struct.Struct('<BBHIII')
+TELEMETRY_VERSION = 1
+
+
+def decode(data, event_names):
+    version, count, window_s, seq, timestamp, present = \
+        HEADER.unpack_from(data)
+    if version != TELEMETRY_VERSION:
+        raise ValueError('unsupported telemetry version %d' % version)
+    values = struct.unpack_from('<%df' % count, data, HEADER.size)
+    ids = [i for i in range(32) if present & (1 << i)]
+    return {
+        'seq': seq,
+        'timestamp': timestamp,
+        'window_s': window_s,
+        'values': {
+            (event_names[i] if i < len(event_names) else str(i)):
+                round(v, 3)
+            for i, v in zip(ids, values)
+        },
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('docs', nargs='+', help='one document per file')
+    parser.add_argument('--ext-sensor', action='store_true',
+                        help='firmware built with CONFIG_HAS_EXTERNAL_SENSOR')
+    args = parser.parse_args()
+
+    event_names = EVENT_NAMES + (EXT_EVENT_NAMES if args.ext_sensor else [])
+    for path in args.docs:
+        with open(path, 'rb') as f:
+            json.dump(decode(f.read(), event_names), sys.stdout)
+        sys.stdout.write('\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,144 @@
+#!/usr/bin/env python3
+"""Convert an event trace dump into Chrome trace JSON.
+
+Capture the dump while asking the controller for it, e.g.:
+
+    mosquitto_sub -h bb-master -t barlog/<host>/trace -N > trace.bin &
+    mosquitto_sub -h bb-master -t barlog/<host>/trace/observers -C 1 \
+        > observers.txt &
+    mosquitto_pub -h bb-master -t cmd/<host>/trace -m dump
+
+then convert it and load the result in chrome://tracing or ui.perfetto.dev:
+
+    tools/trace2chrome.py trace.bin --observers observers.txt > trace.json
+"""
+
+import argparse
+import json
+import struct
+import sys
+
+# keep in sync with TraceKind in components/sc-events/include/event_trace.h
+(TRACE_POST, TRACE_DEQUEUE, TRACE_NOTICE_BEGIN, TRACE_NOTICE_END,
+ TRACE_DISPLAY_FLUSH_BEGIN, TRACE_DISPLAY_FLUSH_END,
+ TRACE_MQTT_ENQUEUE_BEGIN, TRACE_MQTT_ENQUEUE_END,
+ TRACE_SENSOR_READ_BEGIN, TRACE_SENSOR_READ_END) = range(10)
+
+# keep in sync with components/sc-events/include/event_registry.h
+EVENT_NAMES = [
+    'status_update', 'heartbeat', 'temperature', 'humidity', 'touched',
+    'gas_status', 'iaq', 'co2', 'voc', 'pressure',
+]
+EXT_EVENT_NAMES = ['ext_temperature', 'ext_humidity']
+OTA_EVENT_NAMES = ['ota_started', 'ota_done_ok', 'ota_done_fail']
+
+LANE_NAMES = ['interactive', 'telemetry']
+
+# one Chrome trace thread per activity
+TID_PRODUCERS, TID_EVENTS, TID_DISPLAY, TID_MQTT, TID_SENSORS = range(1, 6)
+THREAD_NAMES = {
+    TID_PRODUCERS: 'posts',
+    TID_EVENTS: 'eventsTask',
+    TID_DISPLAY: 'display flush',
+    TID_MQTT: 'mqtt enqueue',
+    TID_SENSORS: 'sensor read',
+}
+
+# keep in sync with handleTrace in components/sc-mqtt/mqtt.cpp
+RECORDS_PER_CHUNK = 128
+HEADER = struct.Struct('<4sHH')
+RECORD = struct.Struct('<IBBH')
+
+
+def read_records(data):
+    """Yield (ts_us, kind, id, arg) from the concatenated chunks of a dump."""
+    pos = 0
+    while pos + HEADER.size <= len(data):
+        magic, chunk, chunks = HEADER.unpack_from(data, pos)
+        if magic != b'SCTR':
+            raise ValueError('bad chunk magic at offset %d' % pos)
+        pos += HEADER.size
+        # every chunk but the last one is full
+        if chunk + 1 < chunks:
+            end = pos + RECORDS_PER_CHUNK * RECORD.size
+        else:
+            end = len(data) - (len(data) - pos) % RECORD.size
+        for off in range(pos, min(end, len(data)), RECORD.size):
+            yield RECORD.unpack_from(data, off)
+        pos = end
+
+
+def unwrap(records):
+    """Turn the 32-bit microsecond clock into a monotonic one."""
+    base = 0
+    last = None
+    for ts, kind, ident, arg in records:
+        if last is not None and ts < last and last - ts > 1 << 31:
+            base += 1 << 32
+        last = ts
+        yield base + ts, kind, ident, arg
+
+
+def convert(records, event_names, observers):
+    def event_name(ident):
+        return event_names[ident] if ident < len(event_names) else str(ident)
+
+    out = [{'ph': 'M', 'pid': 1, 'tid': tid, 'name': 'thread_name',
+            'args': {'name': name}} for tid, name in THREAD_NAMES.items()]
+    for ts, kind, ident, arg in records:
+        ev = {'pid': 1, 'ts': ts}
+        if kind == TRACE_POST:
+            ev.update(ph='i', s='t', tid=TID_PRODUCERS,
+                      name='post ' + event_name(ident))
+        elif kind == TRACE_DEQUEUE:
+            lane = LANE_NAMES[arg] if arg < len(LANE_NAMES) else str(arg)
+            ev.update(ph='i', s='t', tid=TID_EVENTS,
+                      name='dequeue ' + event_name(ident),
+                      args={'lane': lane})
+        elif kind in (TRACE_NOTICE_BEGIN, TRACE_NOTICE_END):
+            ev.update(ph='B' if kind == TRACE_NOTICE_BEGIN else 'E',
+                      tid=TID_EVENTS,
+                      name='%s %s' % (observers.get(arg, 'observer %d' % arg),
+                                      event_name(ident)))
+        elif kind in (TRACE_DISPLAY_FLUSH_BEGIN, TRACE_DISPLAY_FLUSH_END):
+            ev.update(ph='B' if kind == TRACE_DISPLAY_FLUSH_BEGIN else 'E',
+                      tid=TID_DISPLAY, name='flush', args={'lines': arg})
+        elif kind in (TRACE_MQTT_ENQUEUE_BEGIN, TRACE_MQTT_ENQUEUE_END):
+            ev.update(ph='B' if kind == TRACE_MQTT_ENQUEUE_BEGIN else 'E',
+                      tid=TID_MQTT, name='enqueue ' + event_name(ident))
+        elif kind in (TRACE_SENSOR_READ_BEGIN, TRACE_SENSOR_READ_END):
+            ev.update(ph='B' if kind == TRACE_SENSOR_READ_BEGIN else 'E',
+                      tid=TID_SENSORS, name='read')
+        else:
+            ev.update(ph='i', s='t', tid=TID_EVENTS, name='kind %d' % kind)
+        out.append(ev)
+    return {'traceEvents': out, 'displayTimeUnit': 'ms'}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('dump', help='concatenated barlog/<host>/trace chunks')
+    parser.add_argument('--observers',
+                        help='barlog/<host>/trace/observers payload')
+    parser.add_argument('--ext-sensor', action='store_true',
+                        help='firmware built with CONFIG_HAS_EXTERNAL_SENSOR')
+    args = parser.parse_args()
+
+    with open(args.dump, 'rb') as f:
+        data = f.read()
+    observers = {}
+    if args.observers:
+        with open(args.observers) as f:
+            for line in f:
+                ident, _, name = line.strip().partition(' ')
+                if name:
+                    observers[int(ident)] = name
+    event_names = EVENT_NAMES + (EXT_EVENT_NAMES if args.ext_sensor else [])
+    event_names += OTA_EVENT_NAMES
+
+    json.dump(convert(unwrap(read_records(data)), event_names, observers),
+              sys.stdout)
+
+
+if __name__ == '__main__':
+    main()